@@ -51,15 +51,38 @@ void wiimote_callback(wiimote_event_type_t event_type, uint16_t wiimote, uint8_t
         ext[10]
       );*/
 
-      float weight[4];
-      wii.get_balance_weight(data, weight);
+      int32_t weight[4]; // grams
+      if (wii.get_balance_weight(wiimote, data, weight))
+      {
+        printf("↖️ %6.3f  ↗️ %6.3f  ↙️ %6.3f  ↘️ %6.3f  🔋:0x%02x\n",
+               weight[BALANCE_POSITION_TOP_LEFT] / 1000.0f,
+               weight[BALANCE_POSITION_TOP_RIGHT] / 1000.0f,
+               weight[BALANCE_POSITION_BOTTOM_LEFT] / 1000.0f,
+               weight[BALANCE_POSITION_BOTTOM_RIGHT] / 1000.0f,
+               ext[10]);
+      }
+      else
+      {
+        printf(" ... Balance Board: not calibrated yet\n");
+      }
 
-      printf("↖️ %6.3f  ↗️ %6.3f  ↙️ %6.3f  ↘️ %6.3f  🔋:0x%02x\n",
-             weight[BALANCE_POSITION_TOP_LEFT],
-             weight[BALANCE_POSITION_TOP_RIGHT],
-             weight[BALANCE_POSITION_BOTTOM_LEFT],
-             weight[BALANCE_POSITION_BOTTOM_RIGHT],
-             ext[10]);
+      // the same weights after set_balance_filter() and tare_balance()
+      const wiimote_report_t *report = wii.get_report();
+      if (report && report->has_weight)
+      {
+        printf("   filtered ↖️ %6.3f  ↗️ %6.3f  ↙️ %6.3f  ↘️ %6.3f  total %6.3f kg\n",
+               report->weight[BALANCE_POSITION_TOP_LEFT] / 1000.0f,
+               report->weight[BALANCE_POSITION_TOP_RIGHT] / 1000.0f,
+               report->weight[BALANCE_POSITION_BOTTOM_LEFT] / 1000.0f,
+               report->weight[BALANCE_POSITION_BOTTOM_RIGHT] / 1000.0f,
+               report->total_weight / 1000.0f);
+      }
+      if (report && report->has_cop)
+      {
+        printf("   center of pressure x=%5.1f mm y=%5.1f mm\n",
+               report->cop[0] / 10.0f,
+               report->cop[1] / 10.0f);
+      }
     }
     else
     {
@@ -71,17 +94,9 @@ void wiimote_callback(wiimote_event_type_t event_type, uint16_t wiimote, uint8_t
       printf("\n");
     }
 
-    bool wiimote_button_down = (data[2] & 0x01) != 0;
-    bool wiimote_button_up = (data[2] & 0x02) != 0;
-    bool wiimote_button_right = (data[2] & 0x04) != 0;
-    bool wiimote_button_left = (data[2] & 0x08) != 0;
-    bool wiimote_button_plus = (data[2] & 0x10) != 0;
-    bool wiimote_button_2 = (data[3] & 0x01) != 0;
-    bool wiimote_button_1 = (data[3] & 0x02) != 0;
-    bool wiimote_button_B = (data[3] & 0x04) != 0;
-    bool wiimote_button_A = (data[3] & 0x08) != 0;
-    bool wiimote_button_minus = (data[3] & 0x10) != 0;
-    bool wiimote_button_home = (data[3] & 0x80) != 0;
+    const wiimote_report_t *report = wii.get_report();
+    bool wiimote_button_plus = report && (report->buttons & WIIMOTE_BUTTON_PLUS) != 0;
+    bool wiimote_button_minus = report && (report->buttons & WIIMOTE_BUTTON_MINUS) != 0;
     static bool rumble = false;
     if (wiimote_button_plus && !rumble)
     {
@@ -118,6 +133,7 @@ void wiimote_callback(wiimote_event_type_t event_type, uint16_t wiimote, uint8_t
   else if (event_type == WIIMOTE_EVENT_CONNECT)
   {
     wii.set_led(wiimote, 1 << connections.size());
+    wii.set_balance_filter(wiimote, 2, true); // ignored unless it is a balance board
     connections.push_back(wiimote);
     printf("✅ Connected Wiimote. Connections:%d\n", connections.size());
   }
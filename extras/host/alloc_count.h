@@ -0,0 +1,38 @@
+#ifndef _ALLOC_COUNT_H_
+#define _ALLOC_COUNT_H_
+
+/**
+ * Counts heap allocations of the whole process while alloc_counting is set, by wrapping the glibc
+ * allocator. Include it in one translation unit of the program.
+ */
+
+#include <atomic>
+#include <cstddef>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static std::atomic<bool> alloc_counting(false);
+static std::atomic<uint32_t> alloc_count(0);
+
+extern "C" void *malloc(size_t size){
+  if(alloc_counting.load(std::memory_order_relaxed)){
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t count, size_t size){
+  if(alloc_counting.load(std::memory_order_relaxed)){
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_calloc(count, size);
+}
+extern "C" void *realloc(void *ptr, size_t size){
+  if(alloc_counting.load(std::memory_order_relaxed)){
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  return __libc_realloc(ptr, size);
+}
+
+#endif
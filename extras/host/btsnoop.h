@@ -0,0 +1,62 @@
+#ifndef _BTSNOOP_H_
+#define _BTSNOOP_H_
+
+/**
+ * Reads the packets received from the controller out of an H4 btsnoop file, as written by
+ * Wiimote::dump_capture().
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct packet_t {
+  std::vector<uint8_t> data;
+  bool data_report; // ACL carrying an input report 0x30-0x3F
+};
+
+static uint32_t be32(const uint8_t *p){
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Appends the received packets in file order. Returns false if the file can't be replayed.
+static bool btsnoop_load(const char *path, std::vector<packet_t> *packets){
+  FILE *file = fopen(path, "rb");
+  if(!file){
+    perror(path);
+    return false;
+  }
+  uint8_t header[16];
+  if(fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "btsnoop\0", 8) != 0 || be32(header + 12) != 1002){
+    fprintf(stderr, "%s: not an H4 btsnoop file\n", path);
+    fclose(file);
+    return false;
+  }
+  uint8_t record[24];
+  while(fread(record, 1, sizeof(record), file) == sizeof(record)){
+    uint32_t original_len = be32(record);
+    uint32_t included_len = be32(record + 4);
+    uint32_t flags        = be32(record + 8);
+    packet_t packet;
+    packet.data.resize(included_len);
+    if(fread(packet.data.data(), 1, included_len, file) != included_len){
+      break;
+    }
+    if(!(flags & 0x01)){ // sent by the stack
+      continue;
+    }
+    if(included_len != original_len){
+      fprintf(stderr, "%s: packet truncated to %u of %u bytes, can't replay\n", path, included_len, original_len);
+      fclose(file);
+      return false;
+    }
+    const std::vector<uint8_t> &d = packet.data;
+    packet.data_report = d.size() >= 11 && d[0] == 0x02 && d[9] == 0xA1 && 0x30 <= d[10] && d[10] <= 0x3F;
+    packets->push_back(packet);
+  }
+  fclose(file);
+  return true;
+}
+
+#endif
@@ -0,0 +1,406 @@
+/**
+ * Writes the replay fixtures: the stack runs against a scripted controller and remotes, with the
+ * capture ring on, and the ring is dumped as btsnoop. The traffic is synthesized from the HCI, L2CAP
+ * and Wiimote formats (https://wiibrew.org/wiki/Wiimote), not recorded from hardware.
+ *
+ *   make_fixtures <connect|extension|sustained> <file.btsnoop>
+ *
+ *   connect   : HCI init, one remote reconnects (no extension), status report, 0x30 reports, disconnect
+ *   extension : HCI init, a Nunchuk and a balance board reconnect; extension detection and calibration
+ *   sustained : HCI init, two Nunchuks (0x32) and a balance board (0x34), then interleaved reports
+ *
+ * Only the stack is real here; the controller answers every command and returns ACL credits at once.
+ */
+#include "Wiimote.h"
+#include "wiimote_host.h"
+#include <deque>
+#include <vector>
+#include <string>
+#include <unistd.h>
+#include "nvs_dir.h"
+
+enum sim_extension_t {
+  SIM_EXTENSION_NONE,
+  SIM_EXTENSION_NUNCHUK,
+  SIM_EXTENSION_BALANCE_BOARD
+};
+
+struct sim_remote_t {
+  uint8_t bd_addr[6];        // as on the wire
+  uint16_t handle;
+  sim_extension_t extension;
+  uint16_t cid[2];           // remote's CIDs, control and interrupt
+  uint16_t stack_cid[2];     // stack's CIDs, 0 = not connected
+  uint8_t mode;              // reporting mode set by the stack, 0 = none yet
+  bool connected;            // WIIMOTE_EVENT_CONNECT seen
+};
+
+static Wiimote wii;
+static std::deque<std::vector<uint8_t>> outbox; // sent by the stack, answered after handle()
+static std::vector<sim_remote_t> remotes;
+static uint8_t sim_identifier = 0x80;
+static uint32_t data_events = 0;
+
+static void callback(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){
+  if(event_type == WIIMOTE_EVENT_CONNECT){
+    for(sim_remote_t &r : remotes){
+      if(r.handle == handle){
+        r.connected = true;
+      }
+    }
+  }
+  if(event_type == WIIMOTE_EVENT_DATA){
+    data_events++;
+  }
+}
+
+static void on_send(uint8_t *data, uint16_t len){
+  outbox.emplace_back(data, data + len);
+}
+
+static void receive(const std::vector<uint8_t> &packet){
+  if(wiimote_host_receive((uint8_t*)packet.data(), packet.size()) != ESP_OK){
+    fprintf(stderr, "receive dropped\n");
+    exit(1);
+  }
+  wii.handle(0, 0);
+}
+
+static void put16(std::vector<uint8_t> &p, uint16_t v){
+  p.push_back(v & 0xFF);
+  p.push_back(v >> 8);
+}
+
+static void event(uint8_t code, const std::vector<uint8_t> &params){
+  std::vector<uint8_t> p = { 0x04, code, (uint8_t)params.size() };
+  p.insert(p.end(), params.begin(), params.end());
+  receive(p);
+}
+
+static void command_complete(uint16_t opcode, const std::vector<uint8_t> &return_params){
+  std::vector<uint8_t> params = { 0x01 }; // Num_HCI_Command_Packets
+  put16(params, opcode);
+  params.insert(params.end(), return_params.begin(), return_params.end());
+  event(0x0E, params);
+}
+
+static void command_status(uint16_t opcode){
+  std::vector<uint8_t> params = { 0x00, 0x01 }; // pending, Num_HCI_Command_Packets
+  put16(params, opcode);
+  event(0x0F, params);
+}
+
+static void l2cap(const sim_remote_t &r, uint16_t cid, const std::vector<uint8_t> &payload){
+  std::vector<uint8_t> p = { 0x02 };
+  put16(p, r.handle | 0b10 << 12); // start of a flushable packet
+  put16(p, payload.size() + 4);
+  put16(p, payload.size());
+  put16(p, cid);
+  p.insert(p.end(), payload.begin(), payload.end());
+  receive(p);
+}
+
+static void hid(const sim_remote_t &r, const std::vector<uint8_t> &report){
+  l2cap(r, r.stack_cid[1], report);
+}
+
+static sim_remote_t *remote_by_handle(uint16_t handle){
+  for(sim_remote_t &r : remotes){
+    if(r.handle == handle){
+      return &r;
+    }
+  }
+  return NULL;
+}
+
+static void connection_request(const sim_remote_t &r, uint16_t psm){
+  std::vector<uint8_t> p = { 0x02, sim_identifier++ };
+  put16(p, 4);
+  put16(p, psm);
+  put16(p, r.cid[psm == 0x0013]);
+  l2cap(r, 0x0001, p);
+}
+
+static void status_report(const sim_remote_t &r){
+  uint8_t flags = r.extension != SIM_EXTENSION_NONE ? 0x02 : 0x00;
+  hid(r, { 0xA1, 0x20, 0x00, 0x00, flags, 0x00, 0x00, 0xC0 });
+}
+
+// Memory as a remote with the extension reports it.
+static uint8_t memory_byte(const sim_remote_t &r, bool control_register, uint32_t address){
+  if(!control_register){
+    // accelerometer calibration at 0x0016: zero 0x80, 1 g 0x9A, low bits 0, checksum 0x55 + sum
+    static const uint8_t accel[10] = { 0x80, 0x80, 0x80, 0x00, 0x9A, 0x9A, 0x9A, 0x00, 0x00, (0x55 + 0x80*3 + 0x9A*3) & 0xFF };
+    return 0x0016 <= address && address < 0x0016 + 10 ? accel[address - 0x0016] : 0x00;
+  }
+  if(0xA400FA <= address && address < 0xA400FA + 6){
+    static const uint8_t nunchuk[6] = { 0x00, 0x00, 0xA4, 0x20, 0x00, 0x00 };
+    static const uint8_t balance[6] = { 0x00, 0x00, 0xA4, 0x20, 0x04, 0x02 };
+    return (r.extension == SIM_EXTENSION_BALANCE_BOARD ? balance : nunchuk)[address - 0xA400FA];
+  }
+  if(0xA40024 <= address && address < 0xA40024 + 24){
+    // 0 kg, 17 kg, 34 kg for TR BR TL BL, big endian
+    int i = (address - 0xA40024) / 2;
+    uint16_t value = 4000 + (i / 4) * 1700 + (i % 4) * 20;
+    return (address - 0xA40024) % 2 == 0 ? value >> 8 : value & 0xFF;
+  }
+  return 0x00;
+}
+
+static void memory_read(const sim_remote_t &r, const uint8_t *hid_data){
+  bool control_register = hid_data[2] & 0x04;
+  uint32_t address = hid_data[3] << 16 | hid_data[4] << 8 | hid_data[5];
+  uint16_t size = hid_data[6] << 8 | hid_data[7];
+  for(uint16_t done = 0; done < size; done += 16){
+    uint8_t chunk = size - done < 16 ? size - done : 16;
+    uint32_t chunk_address = address + done;
+    std::vector<uint8_t> report = { 0xA1, 0x21, 0x00, 0x00, (uint8_t)((chunk - 1) << 4),
+                                    (uint8_t)(chunk_address >> 8), (uint8_t)chunk_address };
+    for(int i=0; i<16; i++){
+      report.push_back(i < chunk ? memory_byte(r, control_register, chunk_address + i) : 0x00);
+    }
+    hid(r, report);
+  }
+}
+
+static void process_hid_output(sim_remote_t &r, const uint8_t *data, uint16_t len){
+  if(len < 2 || data[0] != 0xA2){
+    return;
+  }
+  switch(data[1]){
+  case 0x12: // reporting mode
+    r.mode = data[3];
+    break;
+  case 0x15: // status request
+    status_report(r);
+    break;
+  case 0x16: // write memory
+    hid(r, { 0xA1, 0x22, 0x00, 0x00, 0x16, 0x00 });
+    break;
+  case 0x17: // read memory
+    memory_read(r, data);
+    break;
+  }
+}
+
+static void process_signaling(sim_remote_t &r, const uint8_t *data){
+  switch(data[0]){
+  case 0x03: { // Connection Response: stack's CID, our CID
+    uint16_t stack_cid = data[4] | data[5] << 8;
+    uint16_t cid       = data[6] | data[7] << 8;
+    int channel = cid == r.cid[1];
+    r.stack_cid[channel] = stack_cid;
+    std::vector<uint8_t> p = { 0x04, sim_identifier++ };
+    put16(p, 8);
+    put16(p, stack_cid);
+    put16(p, 0x0000);               // flags
+    p.insert(p.end(), { 0x01, 0x02 });
+    put16(p, 185);                  // MTU
+    l2cap(r, 0x0001, p);
+    break;
+  }
+  case 0x04: { // Configuration Request from the stack, for our CID
+    uint16_t cid = data[4] | data[5] << 8;
+    int channel = cid == r.cid[1];
+    std::vector<uint8_t> p = { 0x05, data[1] };
+    put16(p, 6);
+    put16(p, r.stack_cid[channel]);
+    put16(p, 0x0000);               // flags
+    put16(p, 0x0000);               // success
+    l2cap(r, 0x0001, p);
+    if(channel == 0){
+      connection_request(r, 0x0013);
+    }
+    break;
+  }
+  }
+}
+
+static void process_command(const uint8_t *data, uint16_t len){
+  uint16_t opcode = data[1] | data[2] << 8;
+  switch(opcode){
+  case 0x1005: // Read Buffer Size: ACL 1021 bytes x 8, SCO 64 bytes x 0
+    command_complete(opcode, { 0x00, 0xFD, 0x03, 0x40, 0x08, 0x00, 0x00, 0x00 });
+    break;
+  case 0x1009: // Read BD_ADDR
+    command_complete(opcode, { 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x02 });
+    break;
+  case 0x0409: { // Accept Connection Request
+    command_status(opcode);
+    for(sim_remote_t &r : remotes){
+      if(memcmp(r.bd_addr, data + 4, 6) == 0){
+        std::vector<uint8_t> params = { 0x00 };
+        put16(params, r.handle);
+        params.insert(params.end(), r.bd_addr, r.bd_addr + 6);
+        params.insert(params.end(), { 0x01, 0x00 }); // ACL, not encrypted
+        event(0x03, params);
+        connection_request(r, 0x0011);
+      }
+    }
+    break;
+  }
+  case 0x0401: // Inquiry
+  case 0x0405: // Create Connection
+  case 0x0411: // Authentication Requested
+  case 0x0419: // Remote Name Request
+    command_status(opcode);
+    break;
+  default:
+    command_complete(opcode, { 0x00 });
+  }
+}
+
+static void process_acl(const uint8_t *data, uint16_t len){
+  uint16_t handle = (data[1] | data[2] << 8) & 0x0FFF;
+  std::vector<uint8_t> params = { 0x01 };
+  put16(params, handle);
+  put16(params, 1);
+  event(0x13, params); // Number Of Completed Packets
+  sim_remote_t *r = remote_by_handle(handle);
+  if(!r || len < 9){
+    return;
+  }
+  uint16_t channel_id = data[7] | data[8] << 8;
+  if(channel_id == 0x0001){
+    process_signaling(*r, data + 9);
+  }else{
+    process_hid_output(*r, data + 9, len - 9);
+  }
+}
+
+// Answers whatever the stack sent until it goes quiet.
+static void run(void){
+  wii.handle(0, 0);
+  while(!outbox.empty()){
+    std::vector<uint8_t> packet = outbox.front();
+    outbox.pop_front();
+    if(packet[0] == 0x01){
+      process_command(packet.data(), packet.size());
+    }else if(packet[0] == 0x02){
+      process_acl(packet.data(), packet.size());
+    }
+  }
+}
+
+static void connect(sim_remote_t &r){
+  std::vector<uint8_t> params(r.bd_addr, r.bd_addr + 6);
+  params.insert(params.end(), { 0x04, 0x25, 0x00, 0x01 }); // Class_of_Device, ACL
+  event(0x04, params);
+  run();
+  if(!r.connected){
+    fprintf(stderr, "remote %04X did not connect\n", r.handle);
+    exit(1);
+  }
+  status_report(r);
+  run();
+}
+
+static void data_report(sim_remote_t &r, uint32_t i){
+  uint16_t buttons = (i / 50) % 2 ? 0x0008 : 0x0000; // A, pressed now and then
+  std::vector<uint8_t> report = { 0xA1, r.mode, (uint8_t)(buttons >> 8), (uint8_t)buttons };
+  switch(r.mode){
+  case 0x32: // Nunchuk: stick, accelerometer, buttons
+    report.insert(report.end(), { (uint8_t)(0x80 + i % 16), 0x80, (uint8_t)(0x80 + i % 8), 0x80, 0xB3, 0x03, 0x00, 0x00 });
+    break;
+  case 0x34: // balance board: TR BR TL BL big endian, temperature, battery
+    for(int sensor=0; sensor<4; sensor++){
+      uint16_t value = 5000 + sensor * 30 + i % 20;
+      report.push_back(value >> 8);
+      report.push_back(value & 0xFF);
+    }
+    report.insert(report.end(), { 0x00, 0x00, 0x19, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x83 });
+    break;
+  }
+  hid(r, report);
+}
+
+static sim_remote_t remote(uint8_t n, uint16_t handle, sim_extension_t extension){
+  sim_remote_t r = {};
+  uint8_t bd_addr[6] = { n, 0x00, 0x00, 0x19, 0x1D, 0x00 }; // little endian 00:1D:19:00:00:n
+  memcpy(r.bd_addr, bd_addr, 6);
+  r.handle    = handle;
+  r.extension = extension;
+  r.cid[0]    = 0x0040 + n * 2;
+  r.cid[1]    = 0x0041 + n * 2;
+  return r;
+}
+
+static void writer(void *ctx, const uint8_t *data, size_t len){
+  fwrite(data, 1, len, (FILE*)ctx);
+}
+
+int main(int argc, char **argv){
+  if(argc != 3){
+    fprintf(stderr, "usage: %s <connect|extension|sustained> <file.btsnoop>\n", argv[0]);
+    return 2;
+  }
+  std::string scenario = argv[1];
+  nvs_dir_t nvs_dir("wiimote_fixtures"); // no device cache or link keys from earlier runs
+  if(!nvs_dir.ok){
+    return 1;
+  }
+
+  wii.init(callback);
+  wiimote_host_send_hook = on_send;
+  if(!wii.set_capture(true)){
+    return 1;
+  }
+  run();
+
+  if(scenario == "connect"){
+    remotes = { remote(1, 0x0081, SIM_EXTENSION_NONE) };
+    connect(remotes[0]);
+    for(uint32_t i=0; i<20; i++){
+      data_report(remotes[0], i);
+      run();
+    }
+    std::vector<uint8_t> params = { 0x00 };
+    put16(params, remotes[0].handle);
+    params.push_back(0x13); // Remote User Terminated Connection
+    event(0x05, params);
+    run();
+  }else if(scenario == "extension"){
+    remotes = { remote(1, 0x0081, SIM_EXTENSION_NUNCHUK), remote(2, 0x0082, SIM_EXTENSION_BALANCE_BOARD) };
+    for(sim_remote_t &r : remotes){
+      connect(r);
+    }
+    for(uint32_t i=0; i<10; i++){
+      for(sim_remote_t &r : remotes){
+        data_report(r, i);
+        run();
+      }
+    }
+  }else if(scenario == "sustained"){
+    remotes = { remote(1, 0x0081, SIM_EXTENSION_NUNCHUK), remote(2, 0x0082, SIM_EXTENSION_NUNCHUK),
+                remote(3, 0x0083, SIM_EXTENSION_BALANCE_BOARD) };
+    for(sim_remote_t &r : remotes){
+      connect(r);
+    }
+    for(uint32_t i=0; i<300; i++){
+      for(sim_remote_t &r : remotes){
+        data_report(r, i);
+      }
+      run();
+    }
+  }else{
+    fprintf(stderr, "unknown scenario %s\n", argv[1]);
+    return 2;
+  }
+
+  for(const sim_remote_t &r : remotes){
+    if(r.mode != (r.extension == SIM_EXTENSION_NONE ? 0x30 : r.extension == SIM_EXTENSION_NUNCHUK ? 0x32 : 0x34)){
+      fprintf(stderr, "remote %04X in reporting mode %02X\n", r.handle, r.mode);
+      return 1;
+    }
+  }
+
+  FILE *file = fopen(argv[2], "wb");
+  if(!file){
+    perror(argv[2]);
+    return 1;
+  }
+  size_t bytes = wii.dump_capture(writer, file);
+  fclose(file);
+  printf("%s: %zu bytes, %u data reports\n", argv[2], bytes, data_events);
+  return 0;
+}
@@ -0,0 +1,368 @@
+/**
+ * Microbenchmarks of the stack's hot paths, built against its own source so static functions are
+ * reachable. The remotes are set up by replaying fixtures/sustained.btsnoop (two Nunchuks, a balance
+ * board); the data reports of that capture are the load.
+ *
+ *   microbench [fixtures/sustained.btsnoop]
+ *
+ *   handle   draining a backlog of reports with handle(), handle(0, 0) and handle(16, 0); handle(0, 0)
+ *            under continuous traffic must return after the backlog it started with
+ *   dispatch HCI events through hci_event_handlers against the if/else chain it replaced, with the
+ *            same handlers and the events frequent under load (credits, NOP command events)
+ *   l2cap    L2CAP frames through process_l2cap_data (l2cap_hid_handlers, l2cap_signaling_handlers)
+ *            against the if/else chain it replaced: the fixture's 0xA1 data reports, then frames the
+ *            chain walks to its end (HANDSHAKE, signaling without a handler)
+ *   decode   Wiimote::decode_report over every data reporting mode 0x30-0x3F, one mode at a time and
+ *            mixed, in reports per second
+ *   balance  the board's 0x34 reports through the float get_balance_weight(data, weight) against the
+ *            fixed-point segments of get_balance_weight(handle, data, weight), and the largest difference
+ *            between the two over every sensor value
+ */
+#include "Wiimote.cpp"
+#include "btsnoop.h"
+#include "nvs_dir.h"
+#include <chrono>
+#include <cmath>
+
+static Wiimote wii;
+static std::vector<packet_t> reports; // data reports of the fixture
+static size_t next_report = 0;
+static bool refeed = false;           // every delivered report queues another one
+
+static void receive_report(void){
+  const packet_t &packet = reports[next_report++ % reports.size()];
+  wiimote_host_receive((uint8_t*)packet.data.data(), packet.data.size());
+}
+
+static void bench_callback(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){
+  if(event_type == WIIMOTE_EVENT_DATA && refeed){
+    receive_report();
+  }
+}
+
+template<typename F> static double elapsed_ns(F f){
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(const char *name, double ns, uint32_t count, const char *unit){
+  printf("  %-40s %8.1f ns/%s\n", name, ns / count, unit);
+}
+
+/**
+ * handle
+ */
+#define HANDLE_BACKLOG 64
+#define HANDLE_ROUNDS  20000
+
+template<typename F> static void bench_drain(const char *name, F drain){
+  double ns = 0;
+  for(int round=0; round<HANDLE_ROUNDS; round++){
+    for(int i=0; i<HANDLE_BACKLOG; i++){
+      receive_report();
+    }
+    ns += elapsed_ns(drain);
+  }
+  print_result(name, ns, HANDLE_ROUNDS * HANDLE_BACKLOG, "packet");
+}
+
+static bool bench_handle(void){
+  printf("handle, backlog of %d reports\n", HANDLE_BACKLOG);
+  bench_drain("handle() until drained", []{
+    while(lendata_ring_count(&_rx_ring) != 0){
+      wii.handle();
+    }
+  });
+  bench_drain("handle(0, 0)", []{
+    wii.handle(0, 0);
+  });
+  bench_drain("handle(16, 0) until drained", []{
+    while(wii.handle(16, 0) != 0){}
+  });
+
+  for(int i=0; i<HANDLE_BACKLOG; i++){
+    receive_report();
+  }
+  refeed = true;
+  uint32_t before = stats.rx_packets;
+  int waiting = wii.handle(0, 0);
+  refeed = false;
+  uint32_t received = stats.rx_packets - before;
+  wii.handle(0, 0);
+  printf("  handle(0, 0) under continuous traffic: returned with %d waiting after %u arrived\n", waiting, received);
+  return waiting == HANDLE_BACKLOG && received == HANDLE_BACKLOG;
+}
+
+/**
+ * dispatch
+ */
+#define DISPATCH_ROUNDS 5000000
+
+// the chain hci_event_handlers replaced, same order
+static void dispatch_chain(uint8_t event_code, uint8_t len, uint8_t *data){
+  if(event_code == 0x0E){
+    process_command_complete_event(len, data);
+  }else if(event_code == 0x0F){
+    process_command_status_event(len, data);
+  }else if(event_code == 0x02){
+    process_inquiry_result_event(len, data);
+  }else if(event_code == 0x01){
+    process_inquiry_complete_event(len, data);
+  }else if(event_code == 0x07){
+    process_remote_name_request_complete_event(len, data);
+  }else if(event_code == 0x03){
+    process_connection_complete_event(len, data);
+  }else if(event_code == 0x04){
+    process_connection_request_event(len, data);
+  }else if(event_code == 0x05){
+    process_disconnection_complete_event(len, data);
+  }else if(event_code == 0x17){
+    process_link_key_request_event(len, data);
+  }else if(event_code == 0x16){
+    process_pin_request_event(len, data);
+  }else if(event_code == 0x13){
+    process_number_of_completed_packets_event(len, data);
+  }else if(event_code == 0x0D){
+    process_qos_setup_complete_event(len, data);
+  }else{
+    process_hci_event_no_impl(len, data);
+  }
+}
+
+static void dispatch_table(uint8_t event_code, uint8_t len, uint8_t *data){
+  hci_event_handler_t handler = event_code < HCI_EVENT_TABLE_SIZE ? hci_event_handlers[event_code] : process_hci_event_no_impl;
+  handler(len, data);
+}
+
+struct bench_event_t {
+  uint8_t code;
+  uint8_t len;
+  uint8_t data[5];
+};
+static const bench_event_t bench_events[] = {
+  { 0x13, 5, { 0x01, 0x81, 0x00, 0x00, 0x00 } }, // Number Of Completed Packets, none
+  { 0x13, 5, { 0x01, 0x82, 0x00, 0x00, 0x00 } },
+  { 0x0E, 3, { 0x01, 0x00, 0x00 } },             // Command Complete, NOP
+  { 0x0F, 4, { 0x00, 0x01, 0x00, 0x00 } },       // Command Status, NOP
+};
+#define BENCH_EVENT_COUNT (sizeof(bench_events) / sizeof(bench_events[0]))
+
+template<typename F> static void bench_dispatch_with(const char *name, F dispatch){
+  bench_event_t events[BENCH_EVENT_COUNT];
+  memcpy(events, bench_events, sizeof(events));
+  double ns = elapsed_ns([&]{
+    for(uint32_t i=0; i<DISPATCH_ROUNDS; i++){
+      bench_event_t *e = &events[i % BENCH_EVENT_COUNT];
+      dispatch(e->code, e->len, e->data);
+    }
+  });
+  print_result(name, ns, DISPATCH_ROUNDS, "event");
+}
+
+static void bench_dispatch(void){
+  printf("dispatch\n");
+  bench_dispatch_with("if/else chain", dispatch_chain);
+  bench_dispatch_with("hci_event_handlers", dispatch_table);
+  bench_dispatch_with("process_hci_event (with stats, trace)", process_hci_event);
+}
+
+/**
+ * L2CAP dispatch
+ */
+#define L2CAP_ROUNDS 1000000
+
+// the chain l2cap_signaling_handlers and l2cap_hid_handlers replaced, same order
+static void l2cap_chain(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
+  if(data[0] == 0x02){
+    process_l2cap_connection_request(connection_handle, channel_id, data, len);
+  }else if(data[0] == 0x03){
+    process_l2cap_connection_response(connection_handle, channel_id, data, len);
+  }else if(data[0] == 0x05){
+    process_l2cap_configuration_response(connection_handle, channel_id, data, len);
+  }else if(data[0] == 0x04){
+    process_l2cap_configuration_request(connection_handle, channel_id, data, len);
+  }else if(data[0] == 0xA1){
+    process_extension_controller_reports(connection_handle, channel_id, data, len);
+    process_report(connection_handle, data, len);
+  }else if(data[0] == 0x06){
+    process_l2cap_connection_close(connection_handle, channel_id, data, len);
+  }else{
+    process_l2cap_no_impl(connection_handle, channel_id, data, len);
+  }
+}
+
+struct bench_frame_t {
+  uint16_t connection_handle;
+  uint16_t channel_id;
+  std::vector<uint8_t> data; // L2CAP payload
+};
+
+template<typename F> static void bench_l2cap_with(const char *name, std::vector<bench_frame_t> frames, F dispatch){
+  double ns = elapsed_ns([&]{
+    for(uint32_t i=0; i<L2CAP_ROUNDS; i++){
+      bench_frame_t &f = frames[i % frames.size()];
+      dispatch(f.connection_handle, f.channel_id, f.data.data(), (uint16_t)f.data.size());
+    }
+  });
+  print_result(name, ns, L2CAP_ROUNDS, "frame");
+}
+
+static void bench_l2cap(void){
+  std::vector<bench_frame_t> data_frames; // the 0xA1 data reports of the fixture
+  for(const packet_t &packet : reports){
+    const uint8_t *d = packet.data.data(); // H4 type, ACL header, L2CAP header, payload
+    data_frames.push_back({ (uint16_t)(((d[2] & 0x0F) << 8) | d[1]), (uint16_t)((d[8] << 8) | d[7]),
+                            std::vector<uint8_t>(d + 9, d + packet.data.size()) });
+  }
+  // frames without a handler, every one the whole chain is walked for
+  std::vector<bench_frame_t> other_frames = {
+    { 0x0081, 0x0041, { 0x00 } },                                           // HANDSHAKE successful
+    { 0x0081, 0x0001, { 0x01, 0x10, 0x02, 0x00, 0x00, 0x00 } },             // COMMAND REJECT
+    { 0x0082, 0x0001, { 0x0B, 0x11, 0x04, 0x00, 0x02, 0x00, 0x01, 0x00 } }, // INFORMATION RESPONSE, not supported
+  };
+  printf("l2cap dispatch, data reports\n");
+  bench_l2cap_with("if/else chain", data_frames, l2cap_chain);
+  bench_l2cap_with("process_l2cap_data", data_frames, process_l2cap_data);
+  printf("l2cap dispatch, HANDSHAKE and signaling without a handler\n");
+  bench_l2cap_with("if/else chain", other_frames, l2cap_chain);
+  bench_l2cap_with("process_l2cap_data", other_frames, process_l2cap_data);
+}
+
+/**
+ * decode
+ */
+#define DECODE_ROUNDS 10000000
+#define DECODE_REPORT_SIZE 23 // A1, id, 21 bytes
+
+static void bench_decode_with(const char *name, const uint8_t (*reports)[DECODE_REPORT_SIZE], uint32_t count){
+  wiimote_report_t report;
+  volatile uint32_t sink = 0;
+  double ns = elapsed_ns([&]{
+    for(uint32_t i=0; i<DECODE_ROUNDS; i++){
+      Wiimote::decode_report(reports[i % count], DECODE_REPORT_SIZE, &report);
+      sink = sink + report.buttons + report.accel[0] + report.ir_len + report.ext_len;
+    }
+  });
+  printf("  %-40s %8.1f ns/report %6.1f M reports/s\n", name, ns / DECODE_ROUNDS, DECODE_ROUNDS * 1e3 / ns);
+}
+
+static void bench_decode(void){
+  static const uint8_t modes[] = { 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x3D, 0x3E, 0x3F };
+  const size_t mode_count = sizeof(modes) / sizeof(modes[0]);
+  uint8_t reports[mode_count][DECODE_REPORT_SIZE];
+  for(size_t m=0; m<mode_count; m++){
+    reports[m][0] = 0xA1;
+    reports[m][1] = modes[m];
+    for(int i=2; i<DECODE_REPORT_SIZE; i++){
+      reports[m][i] = (uint8_t)(m * 37 + i * 11);
+    }
+  }
+  printf("decode\n");
+  for(size_t m=0; m<mode_count; m++){
+    char name[16];
+    snprintf(name, sizeof(name), "0x%02X", modes[m]);
+    bench_decode_with(name, &reports[m], 1);
+  }
+  bench_decode_with("all modes, interleaved", reports, mode_count);
+}
+
+/**
+ * balance
+ */
+#define BALANCE_HANDLE 0x0083
+#define BALANCE_ROUNDS 2000000
+
+static std::vector<std::vector<uint8_t>> balance_reports; // 0xA1 0x34 ..., as the callback gets them
+
+static bool bench_balance(void){
+  for(const packet_t &packet : reports){
+    const uint8_t *d = packet.data.data();
+    uint16_t handle = (d[2] & 0x0F) << 8 | d[1];
+    if(handle == BALANCE_HANDLE && 9 + 12 <= packet.data.size() && d[10] == 0x34){
+      balance_reports.emplace_back(d + 9, d + packet.data.size()); // after H4, ACL and L2CAP headers
+    }
+  }
+  int32_t check[4];
+  if(balance_reports.empty() || !wii.get_balance_weight(BALANCE_HANDLE, balance_reports[0].data(), check)){
+    printf("balance: no calibrated board at %04X\n", BALANCE_HANDLE);
+    return false;
+  }
+  printf("balance, %zu reports of handle %04X\n", balance_reports.size(), BALANCE_HANDLE);
+  volatile float float_sink = 0;
+  volatile int32_t fixed_sink = 0;
+  double ns = elapsed_ns([&]{
+    for(uint32_t i=0; i<BALANCE_ROUNDS; i++){
+      float weight[4];
+      wii.get_balance_weight(balance_reports[i % balance_reports.size()].data(), weight);
+      float_sink = float_sink + weight[0];
+    }
+  });
+  print_result("float balance_interpolate", ns, BALANCE_ROUNDS, "report");
+  ns = elapsed_ns([&]{
+    for(uint32_t i=0; i<BALANCE_ROUNDS; i++){
+      int32_t weight[4];
+      wii.get_balance_weight(BALANCE_HANDLE, balance_reports[i % balance_reports.size()].data(), weight);
+      fixed_sink = fixed_sink + weight[0];
+    }
+  });
+  print_result("fixed-point balance_sensor_convert", ns, BALANCE_ROUNDS, "report");
+
+  connection_t *c = connection_find(BALANCE_HANDLE);
+  uint16_t cal[12];
+  memcpy(cal, c->balance_calibration, sizeof(cal));
+  float worst = 0;
+  for(uint8_t pos=0; pos<4; pos++){
+    for(uint32_t value=0; value<=0xFFFF; value++){
+      uint16_t values[4] = {};
+      values[pos] = value;
+      float difference = fabsf(balance_interpolate(pos, values, cal) * 1000 - balance_sensor_convert(&c->balance_sensor[pos], value));
+      worst = worst < difference ? difference : worst;
+    }
+  }
+  printf("  largest difference %.2f g\n", worst);
+  return worst <= 2;
+}
+
+int main(int argc, char **argv){
+  const char *path = argc < 2 ? "fixtures/sustained.btsnoop" : argv[1];
+  std::vector<packet_t> packets;
+  if(!btsnoop_load(path, &packets)){
+    return 1;
+  }
+  nvs_dir_t nvs_dir("wiimote_microbench");
+  if(!nvs_dir.ok){
+    return 1;
+  }
+  wii.init(bench_callback);
+  wii.handle(0, 0);
+  for(const packet_t &packet : packets){
+    if(packet.data_report){
+      reports.push_back(packet);
+      continue;
+    }
+    wiimote_host_receive((uint8_t*)packet.data.data(), packet.data.size());
+    int waiting = wii.handle(0, 0);
+    int previous = -1;
+    while(waiting != 0 && waiting != previous){ // stops when only packets without credits are left
+      previous = waiting;
+      waiting = wii.handle(0, 0);
+    }
+  }
+  if(reports.empty() || !connection_find(0x0081)){
+    fprintf(stderr, "%s: no connected remote with data reports\n", path);
+    return 1;
+  }
+
+  bool ok = bench_handle();
+  bench_dispatch();
+  bench_l2cap();
+  bench_decode();
+  ok = bench_balance() && ok;
+  if(stats.rx_dropped != 0){
+    printf("%u packets dropped\n", stats.rx_dropped.load());
+    ok = false;
+  }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
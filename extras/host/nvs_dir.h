@@ -0,0 +1,49 @@
+#ifndef _NVS_DIR_H_
+#define _NVS_DIR_H_
+
+/**
+ * A temporary directory for the host NVS stand-in, so a run starts without a device cache or link keys
+ * from earlier runs. It is wiimote_host_nvs_dir while the object lives and is removed with its files after.
+ * Include it after wiimote_host.h.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct nvs_dir_t {
+  char path[64];
+  bool ok;
+  const char *previous;
+
+  explicit nvs_dir_t(const char *name){
+    snprintf(path, sizeof(path), "/tmp/%s.XXXXXX", name);
+    ok = mkdtemp(path) != NULL;
+    if(!ok){
+      perror("mkdtemp");
+    }
+    previous = wiimote_host_nvs_dir;
+    wiimote_host_nvs_dir = ok ? path : previous;
+  }
+  ~nvs_dir_t(){
+    wiimote_host_nvs_dir = previous;
+    if(!ok){
+      return;
+    }
+    DIR *dir = opendir(path);
+    if(dir){
+      char file[sizeof(path) + 256];
+      for(struct dirent *entry; (entry = readdir(dir)) != NULL; ){
+        if(entry->d_name[0] != '.'){
+          snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+          unlink(file);
+        }
+      }
+      closedir(dir);
+    }
+    rmdir(path);
+  }
+};
+
+#endif
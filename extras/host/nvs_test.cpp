@@ -0,0 +1,115 @@
+/**
+ * Tests of what the stack keeps in NVS, against the host stand-in writing files to a temporary directory.
+ *
+ *   cache  device cache entries are written only by device_cache_flush(), and the least recently connected
+ *          remote's entry is erased to keep DEVICE_CACHE_LIST_SIZE
+ *   forget forget() and forget_handle() delete the link key and cache entry of one remote, clear_link_keys()
+ *          every key
+ *   handle a sketch calling only the no-arg handle() gets its cache entries and link keys written, and a
+ *          link key is written by handle(), not while its notification is processed
+ */
+#include "Wiimote.cpp"
+#include "nvs_dir.h"
+#include "test.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool cache_stored(const bd_addr_t *bd_addr){
+  char key[BD_ADDR_LEN*2 + 1], path[256];
+  device_cache_key(bd_addr, key);
+  snprintf(path, sizeof(path), "%s/%s.%s", wiimote_host_nvs_dir, DEVICE_CACHE_NAMESPACE, key);
+  return access(path, F_OK) == 0;
+}
+
+static int link_keys_stored(void){
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s.%s", wiimote_host_nvs_dir, DEVICE_CACHE_NAMESPACE, LINK_KEY_LIST_NVS_KEY);
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size / sizeof(link_key_t) : 0;
+}
+
+static bd_addr_t remotes[DEVICE_CACHE_LIST_SIZE + 2];
+
+static void test_cache(void){
+  connection_clear();
+  connection_t *c = connection_add(0x0081);
+  for(int i=0; i<DEVICE_CACHE_LIST_SIZE + 2; i++){
+    remotes[i].addr[0] = i + 1;
+    c->bd_addr = remotes[i];
+    c->cache_loaded = false;
+    device_cache_t cache = {};
+    cache.extension = EXTENSION_NUNCHUK;
+    device_cache_update(c, &cache);
+    CHECK(!cache_stored(&remotes[i]));
+    device_cache_flush();
+    CHECK(cache_stored(&remotes[i]));
+    if(i == 3){ // remote 0 reconnects, so remote 1 is the oldest
+      c->bd_addr = remotes[0];
+      device_cache_restore(c);
+      CHECK(c->cache_loaded && c->extension == EXTENSION_NUNCHUK);
+    }
+  }
+  CHECK(device_cache_lru.size == DEVICE_CACHE_LIST_SIZE);
+  CHECK(cache_stored(&remotes[0]));
+  CHECK(!cache_stored(&remotes[1]));
+  CHECK(!cache_stored(&remotes[2]));
+  for(int i=3; i<DEVICE_CACHE_LIST_SIZE + 2; i++){
+    CHECK(cache_stored(&remotes[i]));
+  }
+  // a fresh start reads the same index back
+  device_cache_index_loaded = false;
+  device_cache_lru.size = 0;
+  CHECK(device_cache_index_find(&remotes[0]) == 1); // 3 0 4 5 6 7 8 9
+  CHECK(device_cache_index_find(&remotes[1]) < 0);
+}
+
+// after test_cache: remotes 3 0 4 5 6 7 8 9 are cached
+static void test_forget(void){
+  Wiimote wii;
+  uint8_t key[LINK_KEY_LEN] = {};
+  link_key_add(&remotes[0], key, 0);
+  link_key_add(&remotes[3], key, 0);
+  CHECK(wii.forget(remotes[0].addr));
+  CHECK(!cache_stored(&remotes[0]) && cache_stored(&remotes[3]));
+  CHECK(!link_key_find(&remotes[0]) && link_key_find(&remotes[3]));
+  CHECK(device_cache_lru.size == DEVICE_CACHE_LIST_SIZE - 1);
+  CHECK(!wii.forget(remotes[0].addr));
+  connection_clear();
+  connection_add(0x0081)->bd_addr = remotes[3];
+  CHECK(wii.forget_handle(0x0081));
+  CHECK(!cache_stored(&remotes[3]) && !link_key_find(&remotes[3]));
+  CHECK(!wii.forget_handle(0x0082));
+  link_key_add(&remotes[4], key, 0);
+  wii.clear_link_keys();
+  link_key_list_loaded = false; // read back what is stored
+  CHECK(!link_key_find(&remotes[4]));
+}
+
+static void test_handle(void){
+  static Wiimote wii;
+  wii.init([](wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){});
+  connection_t *c = connection_add(0x0081);
+  bd_addr_t remote = {};
+  remote.addr[0] = 0x42;
+  c->bd_addr = remote;
+  device_cache_t cache = {};
+  cache.extension = EXTENSION_NUNCHUK;
+  device_cache_update(c, &cache);
+  uint8_t key[LINK_KEY_LEN] = {};
+  int keys = link_keys_stored();
+  link_key_add(&remote, key, 0);
+  CHECK(!cache_stored(&remote) && link_keys_stored() == keys);
+  wii.handle();
+  CHECK(cache_stored(&remote) && link_keys_stored() == keys + 1);
+}
+
+int main(){
+  nvs_dir_t nvs_dir("wiimote_nvs_test");
+  if(!nvs_dir.ok){
+    return 1;
+  }
+  test_cache();
+  test_forget();
+  test_handle();
+  return test_result();
+}
@@ -0,0 +1,144 @@
+/**
+ * Replays the received side of a btsnoop capture (H4, as written by Wiimote::dump_capture()) through
+ * the stack, one packet at a time, each followed by Wiimote::handle(0, 0). The stack's own packets in
+ * the file are skipped; it sends them again as it reacts to the replayed ones.
+ *
+ *   replay [-r repeat] file.btsnoop
+ *
+ * -r replays the file's data reports (0x30-0x3F) that many more times after the full pass, on the
+ * connections the pass left open. Exits non-zero if a packet is dropped, a data report is not
+ * delivered to the callback or the stack allocates memory while handling a data report. (Setup packets
+ * may allocate: the host NVS stand-in goes through stdio.)
+ */
+#include "Wiimote.h"
+#include "wiimote_host.h"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include "alloc_count.h"
+#include "btsnoop.h"
+#include "nvs_dir.h"
+
+static uint32_t report_allocations = 0; // while handling data reports
+
+/**
+ * Replay
+ */
+static Wiimote wii;
+static uint32_t delivered = 0;
+
+static void callback(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){
+  if(event_type == WIIMOTE_EVENT_DATA && len >= 2 && 0x30 <= data[1] && data[1] <= 0x3F){
+    delivered++;
+  }
+}
+
+// Hands one packet to the stack and lets it finish with it, including what it sends in reply.
+static void feed(const packet_t &packet){
+  wiimote_host_receive((uint8_t*)packet.data.data(), packet.data.size());
+  int waiting = wii.handle(0, 0);
+  int previous = -1;
+  while(waiting != 0 && waiting != previous){ // stops when only packets without credits are left
+    previous = waiting;
+    waiting = wii.handle(0, 0);
+  }
+}
+
+static uint32_t percentile(const uint32_t *buckets, uint32_t total, double p){
+  uint32_t sum = 0;
+  for(int i=0; i<WIIMOTE_LATENCY_BUCKETS; i++){
+    sum += buckets[i];
+    if(total * p <= sum){
+      return 2u << i; // upper bound of the bucket
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  uint32_t repeat = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "r:")) != -1){
+    if(opt == 'r'){
+      repeat = strtoul(optarg, NULL, 0);
+    }else{
+      fprintf(stderr, "usage: %s [-r repeat] file.btsnoop\n", argv[0]);
+      return 2;
+    }
+  }
+  if(optind + 1 != argc){
+    fprintf(stderr, "usage: %s [-r repeat] file.btsnoop\n", argv[0]);
+    return 2;
+  }
+  const char *path = argv[optind];
+  std::vector<packet_t> packets;
+  if(!btsnoop_load(path, &packets)){
+    return 1;
+  }
+  std::vector<const packet_t*> schedule;
+  for(const packet_t &packet : packets){
+    schedule.push_back(&packet);
+  }
+  for(uint32_t i=0; i<repeat; i++){
+    for(const packet_t &packet : packets){
+      if(packet.data_report){
+        schedule.push_back(&packet);
+      }
+    }
+  }
+  uint32_t data_reports = 0;
+  for(const packet_t *packet : schedule){
+    data_reports += packet->data_report;
+  }
+
+  nvs_dir_t nvs_dir("wiimote_replay"); // the capture starts without a device cache
+  if(!nvs_dir.ok){
+    return 1;
+  }
+  wii.init(callback);
+  wii.handle(0, 0);
+
+  std::vector<uint32_t> durations(schedule.size()); // ns per packet
+  alloc_counting = true;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i=0; i<schedule.size(); i++){
+    uint32_t before = alloc_count;
+    auto t0 = std::chrono::steady_clock::now();
+    feed(*schedule[i]);
+    durations[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    if(schedule[i]->data_report){
+      report_allocations += alloc_count - before;
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  alloc_counting = false;
+
+  wiimote_stats_t stats;
+  wii.get_stats(&stats);
+  std::sort(durations.begin(), durations.end());
+  printf("%s\n", path);
+  printf("  packets       %zu (%u data reports), %.0f packets/s\n", schedule.size(), data_reports, schedule.size() / seconds);
+  printf("  per packet    p50 %u ns, p99 %u ns, max %u ns\n",
+    durations[durations.size() / 2], durations[durations.size() * 99 / 100], durations.back());
+  printf("  rx            %u packets, %u dropped, %u unhandled\n", stats.rx_packets, stats.rx_dropped, stats.unhandled);
+  printf("  tx            %u packets, %u dropped\n", stats.tx_packets, stats.tx_dropped);
+  printf("  delivered     %u data reports\n", delivered);
+  printf("  allocations   %u, %u while handling data reports\n", alloc_count.load(), report_allocations);
+  for(int i=0; i<WIIMOTE_STATS_CONNECTIONS; i++){
+    wiimote_latency_t latency;
+    if(stats.connection[i].handle == 0 || !wii.get_latency(stats.connection[i].handle, &latency)){
+      continue;
+    }
+    uint32_t total = 0;
+    for(int b=0; b<WIIMOTE_LATENCY_BUCKETS; b++){
+      total += latency.residency[b];
+    }
+    printf("  handle %04X   %u reports, residency p50 < %u us, p99 < %u us\n", stats.connection[i].handle,
+      stats.connection[i].reports, percentile(latency.residency, total, 0.50), percentile(latency.residency, total, 0.99));
+  }
+
+  bool ok = stats.rx_dropped == 0 && stats.tx_dropped == 0 && delivered == data_reports && report_allocations == 0;
+  printf("  %s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+/**
+ * Tests of the RX ring (lendata_ring_*), built against the stack's own source so the static functions are
+ * reachable:
+ *
+ *   wrap   records of every size straddle the end of the buffer and come back intact and in order
+ *   full   reserve fails once the buffer is full, from any start position, and succeeds again once drained
+ *   load   a producer and a consumer thread move records through the ring concurrently; no packet is
+ *          lost or reordered and nothing is allocated after init
+ */
+#include "Wiimote.cpp"
+#include "alloc_count.h"
+#include "test.h"
+#include <thread>
+
+static size_t record_len(uint32_t n, size_t max){
+  return 1 + (n * 7) % max;
+}
+static uint8_t record_byte(uint32_t n, size_t i){
+  return (uint8_t)(n * 31 + i);
+}
+
+static bool put(lendata_ring_t *ring, uint32_t n, size_t len){
+  lendata_t *lendata = lendata_ring_reserve(ring, len);
+  if(!lendata){
+    return false;
+  }
+  lendata->len = len;
+  lendata->timestamp = n;
+  for(size_t i=0; i<len; i++){
+    lendata->data[i] = record_byte(n, i);
+  }
+  lendata_ring_commit(ring, lendata);
+  return true;
+}
+
+static bool take(lendata_ring_t *ring, uint32_t n, size_t len){
+  lendata_t *lendata = lendata_ring_peek(ring);
+  if(!lendata){
+    return false;
+  }
+  bool ok = lendata->len == len && lendata->timestamp == n;
+  for(size_t i=0; ok && i<len; i++){
+    ok = lendata->data[i] == record_byte(n, i);
+  }
+  lendata_ring_release(ring, lendata);
+  return ok;
+}
+
+static void test_wrap(void){
+  lendata_ring_t ring;
+  CHECK(lendata_ring_init(&ring, 512));
+  // two records in flight, with sizes walking the head across every alignment at the end of the buffer
+  uint32_t written = 0, read = 0;
+  for(size_t len=1; len<=200; len++){
+    for(int pass=0; pass<8; pass++){
+      CHECK(put(&ring, written++, len));
+      CHECK(put(&ring, written++, 200 - len + 1));
+      CHECK(lendata_ring_count(&ring) == 2);
+      CHECK(take(&ring, read, len));
+      read++;
+      CHECK(take(&ring, read, 200 - len + 1));
+      read++;
+      CHECK(lendata_ring_count(&ring) == 0);
+      CHECK(lendata_ring_peek(&ring) == NULL);
+    }
+  }
+  free(ring.buf);
+}
+
+static void test_full(void){
+  static const size_t lens[] = { 1, 8, 17, 40, 100 };
+  for(size_t len : lens){
+    for(size_t offset=0; offset<256; offset += offset == 0 ? 16 : 8){ // 8 is not a record boundary
+      lendata_ring_t ring;
+      CHECK(lendata_ring_init(&ring, 256));
+      // move the start of the ring by offset bytes, with 16 and 24 byte records
+      uint32_t n = 0;
+      for(size_t moved=0; moved<offset; n++){
+        size_t step = offset - moved == 24 || 40 <= offset - moved ? 24 : 16;
+        CHECK(put(&ring, n, step - sizeof(lendata_t)));
+        CHECK(take(&ring, n, step - sizeof(lendata_t)));
+        moved += step;
+      }
+      CHECK(ring.head == offset % 256 && ring.tail == offset % 256);
+      uint32_t capacity = 0;
+      while(put(&ring, n + capacity, len)){
+        capacity++;
+        CHECK(capacity <= 256);
+      }
+      CHECK(0 < capacity);
+      CHECK(lendata_ring_count(&ring) == capacity);
+      CHECK(capacity * LENDATA_RECORD_SIZE(len) <= 256);
+      CHECK(lendata_ring_reserve(&ring, len) == NULL);
+      // drained, it takes records again
+      for(uint32_t i=0; i<capacity; i++){
+        CHECK(take(&ring, n, len));
+        n++;
+      }
+      CHECK(lendata_ring_peek(&ring) == NULL);
+      CHECK(put(&ring, n, len));
+      CHECK(take(&ring, n, len));
+      free(ring.buf);
+    }
+  }
+}
+
+static void test_load(void){
+  const uint32_t N = 1000000;
+  lendata_ring_t ring;
+  CHECK(lendata_ring_init(&ring, RX_RING_SIZE));
+  std::atomic<bool> go(false);
+  std::atomic<uint32_t> full(0), bad(0);
+  std::thread producer([&]{
+    while(!go.load()){
+      std::this_thread::yield();
+    }
+    for(uint32_t n=0; n<N; ){
+      if(put(&ring, n, record_len(n, 300))){
+        n++;
+      }else{
+        full.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::yield();
+      }
+    }
+  });
+  std::thread consumer([&]{
+    while(!go.load()){
+      std::this_thread::yield();
+    }
+    for(uint32_t n=0; n<N; ){
+      if(lendata_ring_peek(&ring)){
+        bad.fetch_add(!take(&ring, n, record_len(n, 300)), std::memory_order_relaxed);
+        n++;
+      }else{
+        std::this_thread::yield();
+      }
+    }
+  });
+  alloc_count = 0;
+  alloc_counting = true;
+  go = true;
+  producer.join();
+  consumer.join();
+  alloc_counting = false;
+  CHECK(bad == 0);
+  CHECK(lendata_ring_count(&ring) == 0);
+  CHECK(alloc_count == 0);
+  printf("load: %u records, producer found the ring full %u times, %u allocations\n", N, full.load(), alloc_count.load());
+  free(ring.buf);
+}
+
+int main(){
+  test_wrap();
+  test_full();
+  test_load();
+  return test_result();
+}
@@ -0,0 +1,166 @@
+/**
+ * Tests of what the stack does with received data, from ACL reassembly to the state snapshot.
+ *
+ *   frame  a complete ACL start packet discards a partial frame, short packets are rejected before their
+ *          headers are read
+ *   memory a 0x21 answer for the wrong offset fails the read it was matched to, and requests the remote
+ *          never answers time out, also when only the no-arg handle() is called
+ *   filter repeated interleaved 0x3E/0x3F reports are suppressed, each half against its own last report
+ *   state  get_state() and get_stats() in another thread, while a connection slot is reused by another
+ *          handle, never return the other handle's state or report count
+ */
+#include "Wiimote.cpp"
+#include "test.h"
+#include <thread>
+#include <vector>
+
+static void test_frame(void){
+  connection_clear();
+  connection_t *c = connection_add(0x0081);
+  uint32_t dropped = stats.rx_dropped;
+  uint32_t unhandled = stats.unhandled;
+  // start of a 10 byte frame on CID 0x0040, 6 bytes of it
+  uint8_t start[] = { 0x81, 0x20, 0x06, 0x00,  0x0A, 0x00, 0x40, 0x00,  0xA1, 0x30 };
+  process_acl_data(start, sizeof(start));
+  CHECK(c->rx_frame_len == 6);
+  // a whole frame in one start packet, empty, so nothing is dispatched past the L2CAP header
+  uint8_t whole[] = { 0x81, 0x20, 0x04, 0x00,  0x00, 0x00, 0x40, 0x00 };
+  process_acl_data(whole, sizeof(whole));
+  CHECK(c->rx_frame_len == 0);
+  CHECK(stats.rx_dropped == dropped + 1);
+  CHECK(stats.unhandled == unhandled + 1);
+  // the rest of the discarded frame is a continuation without start
+  uint8_t rest[] = { 0x81, 0x10, 0x04, 0x00,  0x00, 0x00, 0x00, 0x00 };
+  process_acl_data(rest, sizeof(rest));
+  CHECK(c->rx_frame_len == 0);
+  CHECK(stats.rx_dropped == dropped + 2);
+  // too short for the ACL header, and an ACL length too short for the L2CAP header
+  process_acl_data(start, 3);
+  uint8_t short_l2cap[] = { 0x81, 0x20, 0x02, 0x00,  0x00, 0x00 };
+  process_acl_data(short_l2cap, sizeof(short_l2cap));
+  CHECK(c->rx_frame_len == 2);
+  CHECK(stats.unhandled == unhandled + 1);
+}
+
+static std::vector<uint8_t> memory_errors;
+static void memory_callback(uint16_t handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx){
+  memory_errors.push_back(error);
+}
+
+static void test_memory(void){
+  tx_slot_pool_init(&_acl_pool, acl_slots, ACL_SLOT_COUNT);
+  connection_clear();
+  connection_t *c = connection_add(0x0081);
+  c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid = 0x0041;
+  uint8_t buffer[2][32];
+  CHECK(_read_memory(0x0081, WIIMOTE_CONTROL_REGISTER, 0xA40020, 32, buffer[0], memory_callback));
+  CHECK(_read_memory(0x0081, WIIMOTE_CONTROL_REGISTER, 0xA40040, 16, buffer[1], memory_callback));
+  // 16 bytes of the first read, then the second half answered with a wrong offset
+  uint8_t answer[23] = { 0xA1, 0x21, 0x00, 0x00, 0xF0, 0x00, 0x20 };
+  process_memory_read_data(c, answer, sizeof(answer));
+  CHECK(memory_errors.empty() && c->memory_request_list[0].done == 16);
+  answer[6] = 0x50;
+  process_memory_read_data(c, answer, sizeof(answer));
+  CHECK((memory_errors == std::vector<uint8_t>{ WIIMOTE_MEMORY_MISMATCH }));
+  CHECK(c->memory_request_list_size == 1);
+  // the second read is never answered
+  memory_request_expire(c, esp_timer_get_time());
+  CHECK(c->memory_request_list_size == 1);
+  memory_request_expire(c, esp_timer_get_time() + MEMORY_REQUEST_TIMEOUT);
+  CHECK((memory_errors == std::vector<uint8_t>{ WIIMOTE_MEMORY_MISMATCH, WIIMOTE_MEMORY_TIMEOUT }));
+  CHECK(c->memory_request_list_size == 0);
+}
+
+static void test_memory_handle(void){
+  static Wiimote wii;
+  wii.init([](wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){});
+  connection_t *c = connection_add(0x0081);
+  c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid = 0x0041;
+  memory_errors.clear();
+  uint8_t buffer[16];
+  CHECK(_read_memory(0x0081, WIIMOTE_CONTROL_REGISTER, 0xA40020, 16, buffer, memory_callback));
+  wii.handle();
+  CHECK(memory_errors.empty() && c->memory_request_list_size == 1);
+  c->memory_request_list[0].active -= MEMORY_REQUEST_TIMEOUT; // never answered
+  wii.handle();
+  CHECK((memory_errors == std::vector<uint8_t>{ WIIMOTE_MEMORY_TIMEOUT }));
+  CHECK(c->memory_request_list_size == 0);
+}
+
+static void test_filter(void){
+  report_filter_t filter = {};
+  filter.report_ids = WIIMOTE_REPORT_FILTER_ALL;
+  uint8_t halves[2][REPORT_MAX_SIZE];
+  for(int h=0; h<2; h++){
+    halves[h][0] = 0xA1;
+    halves[h][1] = 0x3E + h;
+    for(int i=2; i<REPORT_MAX_SIZE; i++){
+      halves[h][i] = (uint8_t)(h * 100 + i);
+    }
+  }
+  int delivered = 0;
+  for(int i=0; i<10; i++){
+    wiimote_report_t report;
+    CHECK(Wiimote::decode_report(halves[i & 1], REPORT_MAX_SIZE, &report));
+    delivered += !report_filter_duplicate(&filter, &report, halves[i & 1], REPORT_MAX_SIZE);
+  }
+  CHECK(delivered == 2);
+  CHECK(filter.suppressed == 8);
+  wiimote_report_t report;
+  halves[1][10] ^= 1; // the second half changes
+  CHECK(Wiimote::decode_report(halves[1], REPORT_MAX_SIZE, &report));
+  CHECK(!report_filter_duplicate(&filter, &report, halves[1], REPORT_MAX_SIZE));
+}
+
+static void test_state(void){
+  Wiimote wii; // get_state() doesn't need init()
+  connection_clear();
+  std::atomic<bool> done(false);
+  std::atomic<uint32_t> seen(0), wrong(0);
+  std::thread reader([&]{
+    while(!done.load()){
+      wiimote_state_t state;
+      if(wii.get_state(0x0081, &state)){
+        seen.fetch_add(1, std::memory_order_relaxed);
+        wrong.fetch_add(state.buttons != 0 && state.buttons != 0x0081, std::memory_order_relaxed);
+      }
+      wiimote_stats_t copy;
+      wii.get_stats(&copy);
+      wrong.fetch_add(copy.connection[0].handle == 0x0081 && 1 < copy.connection[0].reports, std::memory_order_relaxed);
+      std::this_thread::yield();
+    }
+  });
+  for(int i=0; i<20000; i++){
+    uint16_t handle = i & 1 ? 0x0082 : 0x0081; // both take slot 0 in turn
+    connection_t *c = connection_add(handle);
+    CHECK(c == &connection_list[0]);
+    wiimote_report_t report = {};
+    report.has_buttons = true;
+    report.buttons = handle;
+    for(int r=0; r<4; r++){
+      state_publish(c, &report);
+    }
+    for(int r=0; r<(handle == 0x0081 ? 1 : 4); r++){ // as process_report() counts delivered reports
+      stat_add(stats.connection[0].reports);
+    }
+    if(i % 64 == 0){
+      std::this_thread::yield();
+    }
+    connection_remove(handle);
+  }
+  done = true;
+  reader.join();
+  wiimote_state_t state;
+  CHECK(!wii.get_state(0x0081, &state));
+  CHECK(wrong == 0);
+  printf("state: %u reads of a live handle\n", seen.load());
+}
+
+int main(){
+  test_frame();
+  test_memory();
+  test_memory_handle();
+  test_filter();
+  test_state();
+  return test_result();
+}
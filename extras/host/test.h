@@ -0,0 +1,24 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+/**
+ * CHECK for the host tests: reports a failed condition and carries on, test_result() gives the exit code.
+ */
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(condition) do{ \
+  if(!(condition)){ \
+    printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+    failures++; \
+  } \
+}while(0)
+
+static int test_result(void){
+  printf("%s\n", failures == 0 ? "OK" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
+
+#endif
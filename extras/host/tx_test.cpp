@@ -0,0 +1,105 @@
+/**
+ * Tests of the TX side: the slot pools and the ACL and HCI command schedulers draining them.
+ *
+ *   tx     a packet built into the overflow slot of a full pool stays dropped when a slot frees up
+ *          before it is committed
+ *   acl    a link that has used up its share of ACL credits doesn't hold back the packets of another
+ *   cmd    commands whose Command Complete/Status never comes time out instead of blocking command TX
+ */
+#include "Wiimote.cpp"
+#include "test.h"
+#include <vector>
+
+static void test_tx(void){
+  tx_slot_t slots[4];
+  tx_slot_pool_t pool;
+  tx_slot_pool_init(&pool, slots, 4);
+  for(int i=0; i<4; i++){
+    uint8_t *buf = tx_slot_acquire(&pool);
+    buf[0] = i;
+    CHECK(tx_slot_commit(&pool, 1) == ESP_OK);
+  }
+  uint8_t *buf = tx_slot_acquire(&pool);
+  CHECK(buf == pool.overflow.data);
+  buf[0] = 0xFF;
+  tx_slot_t *slot = tx_slot_peek(&pool);
+  CHECK(slot && slot->data[0] == 0);
+  tx_slot_release(&pool); // the consumer frees a slot between acquire and commit
+  CHECK(tx_slot_commit(&pool, 1) == ESP_FAIL);
+  CHECK(tx_slot_count(&pool) == 3);
+  for(int i=1; i<4; i++){
+    slot = tx_slot_peek(&pool);
+    CHECK(slot && slot->data[0] == i && slot->len == 1);
+    tx_slot_release(&pool);
+  }
+  CHECK(tx_slot_peek(&pool) == NULL);
+}
+
+static std::vector<uint16_t> sent_handles;
+
+static void queue_acl(uint16_t connection_handle){
+  uint8_t *buf = tx_slot_acquire(&_acl_pool);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, 0b10, 0b00, 0x0041, 0);
+  CHECK(tx_slot_commit(&_acl_pool, len) == ESP_OK);
+}
+
+static void test_acl(void){
+  tx_slot_pool_init(&_acl_pool, acl_slots, ACL_SLOT_COUNT);
+  connection_clear();
+  connection_add(0x0081);
+  connection_add(0x0082);
+  acl_data_packet_length = 1021;
+  acl_total_packets = 4; // a share of 2 each
+  acl_credits = 4;
+  wiimote_host_send_hook = [](uint8_t *data, uint16_t len){
+    sent_handles.push_back(((data[2] & 0x0F) << 8) | data[1]);
+  };
+  for(int i=0; i<4; i++){
+    queue_acl(0x0081); // 0x0081 never completes its packets
+  }
+  queue_acl(0x0082);
+  queue_acl(0x0082);
+  while(_handle_acl_tx()){}
+  CHECK((sent_handles == std::vector<uint16_t>{ 0x0081, 0x0081, 0x0082, 0x0082 }));
+  CHECK(tx_slot_count(&_acl_pool) == 2);
+  acl_credit_return(0x0081, 2);
+  while(_handle_acl_tx()){}
+  CHECK(sent_handles.size() == 6 && sent_handles[4] == 0x0081 && sent_handles[5] == 0x0081);
+  CHECK(tx_slot_count(&_acl_pool) == 0);
+  wiimote_host_send_hook = NULL;
+}
+
+static int timeouts = 0;
+
+static void test_cmd(void){
+  tx_slot_pool_init(&_cmd_pool, cmd_slots, CMD_SLOT_COUNT);
+  hci_command_clear();
+  wiimote_host_send_hook = [](uint8_t *data, uint16_t len){};
+  for(int i=0; i<HCI_COMMAND_LIST_SIZE + 1; i++){
+    uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+    uint16_t len = make_cmd_reset(buf);
+    CHECK(tx_slot_commit(&_cmd_pool, len, [](uint8_t status, uint8_t *data, uint8_t len){
+      timeouts += status == HCI_STATUS_TIMEOUT;
+    }) == ESP_OK);
+  }
+  hci_command_credits = HCI_COMMAND_LIST_SIZE + 1;
+  while(_handle_cmd_tx()){}
+  CHECK(hci_command_list_size == HCI_COMMAND_LIST_SIZE); // every event lost, the list is full
+  CHECK(tx_slot_count(&_cmd_pool) == 1);
+  CHECK(!_handle_cmd_tx());
+  for(int i=0; i<hci_command_list_size; i++){
+    hci_command_list[i].sent -= HCI_COMMAND_TIMEOUT;
+  }
+  CHECK(_handle_cmd_tx());
+  CHECK(timeouts == HCI_COMMAND_LIST_SIZE);
+  CHECK(hci_command_list_size == 1);
+  CHECK(tx_slot_count(&_cmd_pool) == 0);
+  wiimote_host_send_hook = NULL;
+}
+
+int main(){
+  test_tx();
+  test_acl();
+  test_cmd();
+  return test_result();
+}
@@ -1,9 +1,16 @@
+#ifdef WIIMOTE_HOST
+#include "wiimote_host.h"
+#else
 #include <esp_bt.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
 #include <esp32-hal-log.h>
 #include <esp32-hal-bt.h>
 #include <esp_mac.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#endif
+#include <algorithm>
+#include <atomic>
 
 #if !defined(CONFIG_BT_ENABLED) || !defined(CONFIG_BLUEDROID_ENABLED)
 #error Bluetooth is not enabled! Please run `make menuconfig` to and enable it
@@ -21,8 +28,6 @@
 
 static Wiimote *_singleton = NULL;
 
-static uint8_t tmp_data[256];
-static bool wiimoteConnected = false;
 static uint8_t _g_identifier = 1;
 static uint16_t _g_local_cid = 0x0030;
 
@@ -33,32 +38,334 @@ static uint16_t balance_calibration[12];
  */
 typedef struct {
   size_t len;
+  int64_t timestamp; // esp_timer microseconds when the controller handed the packet over
   uint8_t data[];
 } lendata_t;
-#define RX_QUEUE_SIZE 32
-#define TX_QUEUE_SIZE 32
-static xQueueHandle _rx_queue = NULL;
-static xQueueHandle _tx_queue = NULL;
-static esp_err_t _queue_data(xQueueHandle queue, uint8_t *data, size_t len){
-  if(!data || !len){
-    log_w("No data provided");
-    return ESP_OK;
-  }
-  lendata_t * lendata = (lendata_t*)malloc(sizeof(lendata_t) + len);
-  if(!lendata){
-    log_e("lendata Malloc Failed!");
-    return ESP_FAIL;
+
+/**
+ * Stats
+ * Counters are written from the VHCI callback, handle() and whichever task queues a packet (rx_dropped and the
+ * TX counters have more than one writer), so they are updated with atomic read-modify-writes. get_stats() can
+ * read them from any task.
+ * The per-connection counters are written only by handle(): the slot's reports are zeroed before its handle is
+ * set, and get_stats() reads the handle again after the reports, so a slot reused meanwhile is read again.
+ */
+struct connection_counters_t {
+  std::atomic<uint16_t> handle; // 0 = slot unused
+  std::atomic<uint32_t> reports;
+};
+struct stats_counters_t {
+  std::atomic<uint32_t> rx_packets;
+  std::atomic<uint32_t> rx_bytes;
+  std::atomic<uint32_t> rx_dropped;
+  std::atomic<uint32_t> rx_high_water;
+  std::atomic<uint32_t> tx_packets;
+  std::atomic<uint32_t> tx_bytes;
+  std::atomic<uint32_t> tx_dropped;
+  std::atomic<uint32_t> tx_high_water;
+  std::atomic<uint32_t> alloc_failures;
+  std::atomic<uint32_t> unhandled;
+  std::atomic<uint32_t> connections;
+  std::atomic<uint32_t> reconnects;
+  std::atomic<uint32_t> disconnects;
+  std::atomic<uint32_t> name_requests_skipped;
+  std::atomic<uint32_t> hci_events[WIIMOTE_STATS_HCI_EVENTS];
+  connection_counters_t connection[WIIMOTE_STATS_CONNECTIONS]; // same index as connection_list
+};
+static stats_counters_t stats;
+
+static inline void stat_add(std::atomic<uint32_t> &counter, uint32_t n = 1){
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+static inline void stat_max(std::atomic<uint32_t> &counter, uint32_t value){
+  uint32_t current = counter.load(std::memory_order_relaxed);
+  while(current < value && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed)){}
+}
+static void stats_clear(void){
+  stats.rx_packets.store(0, std::memory_order_relaxed);
+  stats.rx_bytes.store(0, std::memory_order_relaxed);
+  stats.rx_dropped.store(0, std::memory_order_relaxed);
+  stats.rx_high_water.store(0, std::memory_order_relaxed);
+  stats.tx_packets.store(0, std::memory_order_relaxed);
+  stats.tx_bytes.store(0, std::memory_order_relaxed);
+  stats.tx_dropped.store(0, std::memory_order_relaxed);
+  stats.tx_high_water.store(0, std::memory_order_relaxed);
+  stats.alloc_failures.store(0, std::memory_order_relaxed);
+  stats.unhandled.store(0, std::memory_order_relaxed);
+  stats.connections.store(0, std::memory_order_relaxed);
+  stats.reconnects.store(0, std::memory_order_relaxed);
+  stats.disconnects.store(0, std::memory_order_relaxed);
+  stats.name_requests_skipped.store(0, std::memory_order_relaxed);
+  for(int i=0; i<WIIMOTE_STATS_HCI_EVENTS; i++){
+    stats.hci_events[i].store(0, std::memory_order_relaxed);
   }
-  lendata->len = len;
-  memcpy(lendata->data, data, len);
-  if (xQueueSend(queue, &lendata, portMAX_DELAY) != pdPASS) {
-    log_e("xQueueSend failed");
-    free(lendata);
+}
+
+/**
+ * bd_addr LRU list
+ * A fixed array of entries that start with their bd_addr_t, least recently used first. Adding a remote to a
+ * full list evicts the oldest entry. The array stays plain, so it can be stored as an NVS blob as it is.
+ */
+struct bd_addr_lru_t {
+  uint8_t *entries;
+  size_t entry_size;
+  int capacity;
+  int size;
+};
+#define BD_ADDR_LRU(list) { (uint8_t*)(list), sizeof((list)[0]), (int)(sizeof(list) / sizeof((list)[0])), 0 }
+
+static void* bd_addr_lru_at(const bd_addr_lru_t *lru, int i){
+  return lru->entries + lru->entry_size * i;
+}
+static int bd_addr_lru_find(const bd_addr_lru_t *lru, const bd_addr_t *bd_addr){
+  for(int i=0; i<lru->size; i++){
+    if(memcmp(bd_addr->addr, bd_addr_lru_at(lru, i), BD_ADDR_LEN) == 0){
+      return i;
+    }
+  }
+  return -1;
+}
+static void bd_addr_lru_remove(bd_addr_lru_t *lru, int i){
+  memmove(bd_addr_lru_at(lru, i), bd_addr_lru_at(lru, i+1), lru->entry_size * (lru->size - i - 1));
+  lru->size--;
+}
+// makes entry i the most recently used one
+static void bd_addr_lru_touch(bd_addr_lru_t *lru, int i){
+  std::rotate((uint8_t*)bd_addr_lru_at(lru, i), (uint8_t*)bd_addr_lru_at(lru, i+1), (uint8_t*)bd_addr_lru_at(lru, lru->size));
+}
+// Returns a new newest entry with bd_addr set, after dropping the remote's older entry or, when full, the oldest.
+static void* bd_addr_lru_add(bd_addr_lru_t *lru, const bd_addr_t *bd_addr){
+  int i = bd_addr_lru_find(lru, bd_addr);
+  if(0 <= i){
+    bd_addr_lru_remove(lru, i);
+  }else if(lru->size == lru->capacity){
+    bd_addr_lru_remove(lru, 0);
+  }
+  void *entry = bd_addr_lru_at(lru, lru->size++);
+  memcpy(entry, bd_addr, sizeof(bd_addr_t));
+  return entry;
+}
+
+// remotes connected before, to tell reconnects from first connections
+#define SEEN_DEVICE_LIST_SIZE 8
+static bd_addr_t seen_device_list[SEEN_DEVICE_LIST_SIZE];
+static bd_addr_lru_t seen_device_lru = BD_ADDR_LRU(seen_device_list);
+
+// returns true if bd_addr was seen before, otherwise remembers it
+static bool seen_device_check(const bd_addr_t *bd_addr){
+  int i = bd_addr_lru_find(&seen_device_lru, bd_addr);
+  if(0 <= i){
+    bd_addr_lru_touch(&seen_device_lru, i);
+    return true;
+  }
+  bd_addr_lru_add(&seen_device_lru, bd_addr);
+  return false;
+}
+
+/**
+ * TX slot pool
+ * Packets are built directly into a fixed-size slot and sent from it by handle().
+ * When every slot is in use, tx_slot_acquire() hands out a scratch slot that tx_slot_commit() drops.
+ * HCI commands and ACL data use separate pools so that neither blocks the other while out of credits.
+ * Single producer: packets are queued from the task that runs handle() (see Wiimote.h).
+ */
+#define CMD_SLOT_COUNT 16
+#define ACL_SLOT_COUNT 16
+#define TX_SLOT_SIZE  256
+typedef void (* hci_command_complete_t)(uint8_t status, uint8_t *data, uint8_t len);
+struct tx_slot_t {
+  uint16_t len;
+  uint16_t offset;                 // ACL only: L2CAP bytes already sent, when segmented
+  bool sent;                       // ACL only: sent ahead of older packets, freed once those are
+  hci_command_complete_t complete; // HCI commands only
+  uint8_t data[TX_SLOT_SIZE];
+};
+struct tx_slot_pool_t {
+  tx_slot_t *slots;
+  uint32_t count;
+  tx_slot_t overflow;
+  tx_slot_t *acquired;        // slot handed out by tx_slot_acquire(), producer only
+  std::atomic<uint32_t> head; // slots committed, written by the producer only
+  std::atomic<uint32_t> tail; // slots sent, written by the consumer only
+  uint32_t sent_ahead;        // slots sent but not yet freed, consumer only
+};
+static tx_slot_t cmd_slots[CMD_SLOT_COUNT];
+static tx_slot_t acl_slots[ACL_SLOT_COUNT];
+static tx_slot_pool_t _cmd_pool;
+static tx_slot_pool_t _acl_pool;
+
+static void tx_slot_pool_init(tx_slot_pool_t *pool, tx_slot_t *slots, uint32_t count){
+  pool->slots = slots;
+  pool->count = count;
+  pool->acquired = &pool->overflow;
+  pool->sent_ahead = 0;
+  pool->head.store(0, std::memory_order_relaxed);
+  pool->tail.store(0, std::memory_order_relaxed);
+}
+
+static bool tx_slot_pool_full(tx_slot_pool_t *pool){
+  return pool->head.load(std::memory_order_relaxed) - pool->tail.load(std::memory_order_acquire) == pool->count;
+}
+
+// producer: returns the buffer the next packet is built into
+static uint8_t* tx_slot_acquire(tx_slot_pool_t *pool){
+  if(tx_slot_pool_full(pool)){
+    pool->acquired = &pool->overflow;
+  }else{
+    pool->acquired = &pool->slots[pool->head.load(std::memory_order_relaxed) % pool->count];
+  }
+  return pool->acquired->data;
+}
+
+// producer: queues the packet built into the buffer from tx_slot_acquire()
+static esp_err_t tx_slot_commit(tx_slot_pool_t *pool, uint16_t len, hci_command_complete_t complete = NULL){
+  // decided by tx_slot_acquire(): a slot freed since then was not written to
+  if(pool->acquired == &pool->overflow){
+    log_e("tx slot pool full, packet dropped");
+    stat_add(stats.tx_dropped);
     return ESP_FAIL;
   }
+  uint32_t head = pool->head.load(std::memory_order_relaxed);
+  pool->acquired->len = len;
+  pool->acquired->offset = 0;
+  pool->acquired->sent = false;
+  pool->acquired->complete = complete;
+  pool->head.store(head + 1, std::memory_order_release);
+  stat_max(stats.tx_high_water, head + 1 - pool->tail.load(std::memory_order_relaxed));
   return ESP_OK;
 }
 
+// consumer: returns the oldest queued packet, or NULL when empty
+static tx_slot_t* tx_slot_peek(tx_slot_pool_t *pool){
+  uint32_t tail = pool->tail.load(std::memory_order_relaxed);
+  if(tail == pool->head.load(std::memory_order_acquire)){
+    return NULL;
+  }
+  return &pool->slots[tail % pool->count];
+}
+
+// consumer: frees the slot returned by tx_slot_peek()
+static void tx_slot_release(tx_slot_pool_t *pool){
+  pool->tail.store(pool->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// consumer: returns the i-th queued packet (0 = oldest), or NULL past the newest
+static tx_slot_t* tx_slot_at(tx_slot_pool_t *pool, uint32_t i){
+  uint32_t tail = pool->tail.load(std::memory_order_relaxed);
+  if(pool->head.load(std::memory_order_acquire) - tail <= i){
+    return NULL;
+  }
+  return &pool->slots[(tail + i) % pool->count];
+}
+
+// consumer: marks a packet returned by tx_slot_at() sent, and frees the sent packets at the front
+static void tx_slot_sent(tx_slot_pool_t *pool, tx_slot_t *slot){
+  slot->sent = true;
+  pool->sent_ahead++;
+  while((slot = tx_slot_peek(pool)) && slot->sent){
+    tx_slot_release(pool);
+    pool->sent_ahead--;
+  }
+}
+
+// slots waiting to be sent
+static uint32_t tx_slot_count(tx_slot_pool_t *pool){
+  return pool->head.load(std::memory_order_acquire) - pool->tail.load(std::memory_order_relaxed) - pool->sent_ahead;
+}
+
+/**
+ * Ring buffer
+ * Single producer / single consumer byte ring holding lendata_t records in place.
+ * The buffer is allocated once at init; reserve/commit and peek/release never allocate.
+ */
+#define RX_RING_SIZE 4096
+#define LENDATA_RECORD_SIZE(len) ((sizeof(lendata_t) + (len) + alignof(lendata_t) - 1) & ~(alignof(lendata_t) - 1))
+#define LENDATA_WRAP ((size_t)-1) // marks the unused tail of the buffer; the reader restarts at 0
+struct lendata_ring_t {
+  uint8_t *buf;
+  size_t size;
+  std::atomic<size_t> head; // written by the producer only
+  std::atomic<size_t> tail; // written by the consumer only
+  std::atomic<uint32_t> committed; // records committed, written by the producer only
+  std::atomic<uint32_t> released;  // records released, written by the consumer only
+};
+static lendata_ring_t _rx_ring;
+
+static bool lendata_ring_init(lendata_ring_t *ring, size_t size){
+  ring->buf = (uint8_t*)malloc(size);
+  if(!ring->buf){
+    return false;
+  }
+  ring->size = size;
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->committed.store(0, std::memory_order_relaxed);
+  ring->released.store(0, std::memory_order_relaxed);
+  return true;
+}
+
+// producer: returns a record with room for len bytes, or NULL when full
+static lendata_t* lendata_ring_reserve(lendata_ring_t *ring, size_t len){
+  size_t need = LENDATA_RECORD_SIZE(len);
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  size_t tail = ring->tail.load(std::memory_order_acquire);
+  if(tail <= head){
+    size_t room = ring->size - head;
+    if(need < room || (need == room && tail != 0)){
+      return (lendata_t*)(ring->buf + head);
+    }
+    if(need < tail){ // wrap to the front
+      if(sizeof(lendata_t) <= room){
+        ((lendata_t*)(ring->buf + head))->len = LENDATA_WRAP;
+      }
+      return (lendata_t*)ring->buf;
+    }
+    return NULL;
+  }
+  if(need < tail - head){
+    return (lendata_t*)(ring->buf + head);
+  }
+  return NULL;
+}
+
+// producer: publishes a record filled in after lendata_ring_reserve()
+static void lendata_ring_commit(lendata_ring_t *ring, lendata_t *lendata){
+  size_t head = ((uint8_t*)lendata - ring->buf) + LENDATA_RECORD_SIZE(lendata->len);
+  if(head == ring->size){
+    head = 0;
+  }
+  ring->head.store(head, std::memory_order_release);
+  ring->committed.store(ring->committed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// consumer: returns the oldest record without removing it, or NULL when empty
+static lendata_t* lendata_ring_peek(lendata_ring_t *ring){
+  size_t tail = ring->tail.load(std::memory_order_relaxed);
+  size_t head = ring->head.load(std::memory_order_acquire);
+  if(tail == head){
+    return NULL;
+  }
+  if(ring->size - tail < sizeof(lendata_t) || ((lendata_t*)(ring->buf + tail))->len == LENDATA_WRAP){
+    tail = 0;
+  }
+  return (lendata_t*)(ring->buf + tail);
+}
+
+// consumer: frees the record returned by lendata_ring_peek()
+static void lendata_ring_release(lendata_ring_t *ring, lendata_t *lendata){
+  size_t tail = ((uint8_t*)lendata - ring->buf) + LENDATA_RECORD_SIZE(lendata->len);
+  if(tail == ring->size){
+    tail = 0;
+  }
+  ring->tail.store(tail, std::memory_order_release);
+  ring->released.store(ring->released.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// records waiting to be released
+static uint32_t lendata_ring_count(lendata_ring_t *ring){
+  return ring->committed.load(std::memory_order_acquire) - ring->released.load(std::memory_order_relaxed);
+}
+
 /**
  * Utils
  */
@@ -74,6 +381,86 @@ static char* formatHex(uint8_t* data, uint16_t len){
   return formatHexBuffer;
 }
 
+/**
+ * Trace
+ * Fixed ring of binary records written on the hot path; formatting happens only in Wiimote::print_trace().
+ */
+#ifndef WIIMOTE_TRACE_SIZE
+#define WIIMOTE_TRACE_SIZE 256 // power of 2
+#endif
+static_assert(WIIMOTE_TRACE_SIZE > 0 && (WIIMOTE_TRACE_SIZE & (WIIMOTE_TRACE_SIZE-1)) == 0, "WIIMOTE_TRACE_SIZE must be a power of 2");
+static wiimote_trace_record_t trace_list[WIIMOTE_TRACE_SIZE];
+static std::atomic<uint32_t> trace_count(0);
+
+// first (up to) 4 bytes, packed so that data[0] is the most significant byte
+static uint32_t _trace_bytes(const uint8_t *data, size_t len){
+  uint32_t v = 0;
+  for(size_t i=0; i<4; i++){
+    v = (v << 8) | (i < len ? data[i] : 0);
+  }
+  return v;
+}
+
+static void _trace(wiimote_trace_event_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2){
+  uint32_t n = trace_count.fetch_add(1, std::memory_order_relaxed);
+  wiimote_trace_record_t *r = &trace_list[n & (WIIMOTE_TRACE_SIZE-1)];
+  r->timestamp = (uint32_t)esp_timer_get_time();
+  r->event     = event;
+  r->arg0      = arg0;
+  r->arg1      = arg1;
+  r->arg2      = arg2;
+}
+
+/**
+ * Capture
+ * Every packet to and from the controller, kept in a fixed ring of snaplen-sized records while enabled.
+ * Capturing is a single memcpy under a short critical section; Wiimote::dump_capture() writes btsnoop.
+ * https://fte.com/webhelpii/hsu/Content/Technical_Information/BT_Snoop_File_Format.htm
+ */
+#ifndef WIIMOTE_CAPTURE_SIZE
+#define WIIMOTE_CAPTURE_SIZE 128 // records
+#endif
+#ifndef WIIMOTE_CAPTURE_SNAPLEN
+#define WIIMOTE_CAPTURE_SNAPLEN 64 // bytes kept per packet, including the H4 type
+#endif
+#define BTSNOOP_DATALINK_H4        1002
+#define BTSNOOP_FLAG_RECEIVED      0x01
+#define BTSNOOP_FLAG_COMMAND_EVENT 0x02
+#define BTSNOOP_EPOCH_OFFSET       0x00DCDDB30F2F8000LL // microseconds from 0000-01-01 to 1970-01-01
+struct capture_record_t {
+  int64_t timestamp;
+  uint16_t original_len;
+  uint16_t included_len;
+  uint8_t flags;
+  uint8_t data[WIIMOTE_CAPTURE_SNAPLEN];
+};
+static capture_record_t *capture_list = NULL;
+static uint32_t capture_count = 0;
+static bool capture_enabled = false;
+static portMUX_TYPE capture_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void _capture(bool received, const uint8_t *data, uint16_t len, int64_t timestamp){
+  if(!capture_enabled){
+    return;
+  }
+  uint8_t flags = (received ? BTSNOOP_FLAG_RECEIVED : 0x00)
+                | (data[0] == 0x01 || data[0] == 0x04 ? BTSNOOP_FLAG_COMMAND_EVENT : 0x00);
+  uint16_t included_len = len < WIIMOTE_CAPTURE_SNAPLEN ? len : WIIMOTE_CAPTURE_SNAPLEN;
+  portENTER_CRITICAL(&capture_mux);
+  capture_record_t *r = &capture_list[capture_count++ % WIIMOTE_CAPTURE_SIZE];
+  r->timestamp    = timestamp;
+  r->original_len = len;
+  r->included_len = included_len;
+  r->flags        = flags;
+  memcpy(r->data, data, included_len);
+  portEXIT_CRITICAL(&capture_mux);
+}
+
+static uint8_t* _capture_be32(uint8_t *p, uint32_t v){
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  return p + 4;
+}
+
 /**
  * Requested connections list
  */
@@ -125,10 +512,17 @@ static void requested_connection_clear(void){
  /**
  * Scanned device list
  */
+enum scanned_device_state_t {
+  SCANNED_DEVICE_PENDING,        // waiting for its remote name request
+  SCANNED_DEVICE_NAME_REQUESTED,
+  SCANNED_DEVICE_DONE
+};
 struct scanned_device_t {
   bd_addr_t bd_addr;
   uint8_t psrm;
   uint16_t clkofs;
+  int8_t rssi; // dBm, 0 without RSSI
+  scanned_device_state_t state;
 };
 static int scanned_device_list_size = 0;
 #define SCANNED_DEVICE_LIST_SIZE 16
@@ -153,503 +547,1668 @@ static void scanned_device_clear(void){
   scanned_device_list_size = 0;
 }
 
+ /**
+ * Known device list
+ * Remotes identified by name before. Kept across scans, so an inquiry result from one of them goes
+ * straight to create_connection without a remote name request. The oldest entry is replaced when full.
+ */
+#define KNOWN_DEVICE_LIST_SIZE 8
+static scanned_device_t known_device_list[KNOWN_DEVICE_LIST_SIZE]; // oldest first
+static bd_addr_lru_t known_device_lru = BD_ADDR_LRU(known_device_list);
+static_assert(offsetof(scanned_device_t, bd_addr) == 0, "bd_addr_lru_t entries start with their bd_addr");
+
+static int known_device_find(const bd_addr_t *bd_addr){
+  return bd_addr_lru_find(&known_device_lru, bd_addr);
+}
+static void known_device_remove(const bd_addr_t *bd_addr){
+  int idx = known_device_find(bd_addr);
+  if(0 <= idx){
+    bd_addr_lru_remove(&known_device_lru, idx);
+  }
+}
+// adds the device as the newest entry, or refreshes its page scan parameters
+static void known_device_add(const scanned_device_t *device){
+  *(scanned_device_t*)bd_addr_lru_add(&known_device_lru, &device->bd_addr) = *device;
+}
+
 /**
- * L2CAP Connection
+ * Connection
+ * Per-remote state. connection_index maps the 12-bit ACL handle straight to a slot in connection_list.
  */
 struct l2cap_connection_t {
-  uint16_t connection_handle;
   uint16_t psm;
   uint16_t local_cid;
   uint16_t remote_cid;
   bool initiator;
 };
-static int l2cap_connection_size = 0;
-#define L2CAP_CONNECTION_LIST_SIZE 8
-static l2cap_connection_t l2cap_connection_list[L2CAP_CONNECTION_LIST_SIZE];
-static int l2cap_connection_find_by_psm(uint16_t connection_handle, uint16_t psm){
-  for(int i=0; i<l2cap_connection_size; i++){
-    l2cap_connection_t *c = &l2cap_connection_list[i];
-    if(connection_handle == c->connection_handle && psm == c->psm){
-      return i;
+#define L2CAP_CHANNEL_CONTROL   0 // PSM_HID_Control_11
+#define L2CAP_CHANNEL_INTERRUPT 1 // PSM_HID_Interrupt_13
+enum extension_type_t {
+  EXTENSION_NONE,
+  EXTENSION_NUNCHUK,
+  EXTENSION_BALANCE_BOARD,
+  EXTENSION_OTHER
+};
+struct accel_calibration_t {
+  uint16_t zero[3];  // x, y, z at 0g (10 bits)
+  int32_t  scale[3]; // [mg/count] Q16
+};
+struct memory_request_t {
+  bool write;
+  uint32_t offset;   // reads: start address (24 bits)
+  uint16_t size;
+  uint16_t done;     // reads: bytes received, writes: chunks acknowledged
+  uint16_t chunks;   // writes: 0x16 reports sent
+  uint8_t error;
+  uint8_t *buffer;
+  wiimote_memory_callback_t callback;
+  void *ctx;
+  int64_t active;    // esp_timer_get_time() when queued or last answered
+};
+#define MEMORY_REQUEST_LIST_SIZE 16
+#define MEMORY_REQUEST_TIMEOUT 1000000 // [us] without an answer
+
+#define REPORT_MAX_SIZE 23 // A1 id + 21 bytes
+// last delivered report, buttons and accelerometer bytes zeroed in data
+struct report_filter_last_t {
+  uint16_t len;
+  uint8_t  data[REPORT_MAX_SIZE];
+  uint16_t buttons;
+  uint16_t accel[3];
+};
+struct report_filter_t {
+  uint32_t report_ids;      // bit n = report id 0x20+n, 0 = filter off
+  uint16_t accel_threshold; // [count] accelerometer change treated as noise
+  uint32_t suppressed;
+  report_filter_last_t last[2]; // [1] for 0x3F, so the interleaved halves 0x3E/0x3F each compare with their own
+};
+struct balance_segment_t {
+  uint16_t base;   // sensor value at the start of the segment
+  uint16_t weight; // [g] at base
+  uint32_t slope;  // [g/count] Q16
+};
+struct balance_sensor_t {
+  balance_segment_t segment[2]; // 0-17kg, 17-34kg (extrapolated above)
+};
+// Persisted per bd_addr, see Device cache. Bytes only, so it has no padding and compares with memcmp.
+struct device_cache_t {
+  uint8_t version;
+  uint8_t extension;                   // extension_type_t
+  uint8_t accel_calibrated;
+  uint8_t accel_calibration_data[10];  // EEPROM 0x16
+  uint8_t balance_calibrated;
+  uint8_t balance_calibration_data[24];
+};
+
+// Per-board stage between the calibrated weights and wiimote_report_t.weight. Values in g * 2^BALANCE_FRACTION_BITS.
+#define BALANCE_FRACTION_BITS 8
+struct balance_filter_t {
+  uint8_t smoothing;     // IIR shift, 0 = off
+  bool median;
+  bool zero_tracking;
+  bool primed;           // history and filtered hold a sample
+  uint8_t history_index;
+  int32_t history[4][3]; // last raw weights per sensor [g]
+  int32_t filtered[4];
+  int32_t tare[4];
+};
+struct connection_t {
+  bool used;
+  uint16_t connection_handle;
+  bd_addr_t bd_addr;
+  l2cap_connection_t l2cap[2];
+  uint16_t acl_outstanding;
+
+  // reporting
+  extension_type_t extension;
+  bool accel_enabled;
+  bool accel_calibrated;
+  accel_calibration_t accel_calibration;
+  wiimote_ir_mode_t ir_mode;
+  wiimote_ir_blob_t ir_blobs[4];
+  report_filter_t report_filter;
+  wiimote_latency_t latency;
+  int64_t last_report_timestamp;
+
+  // L2CAP frame being reassembled from ACL fragments
+  uint16_t rx_frame_len;
+  uint8_t rx_frame[L2CAP_HEADER_SIZE + L2CAP_MTU];
+
+  // 0x16 / 0x17 requests in the order they were sent; the remote answers in the same order
+  memory_request_t memory_request_list[MEMORY_REQUEST_LIST_SIZE];
+  int memory_request_list_size;
+  // destinations of the reads issued by the stack itself
+  uint8_t accel_calibration_data[10];
+  uint8_t extension_id[6];
+  uint8_t balance_calibration_data[24];
+  bool extension_query; // identification of the extension controller in progress
+  device_cache_t cache;  // as stored, valid when cache_loaded
+  bool cache_loaded;
+
+  uint16_t balance_calibration[12];
+  balance_sensor_t balance_sensor[4]; // indexed by balance_position_type_t, valid when balance_calibrated
+  bool balance_calibrated;
+  balance_filter_t balance_filter;
+
+  // output state, repeated in every output report
+  bool rumble;
+};
+#define CONNECTION_LIST_SIZE 7 // active slaves in a piconet
+static_assert(CONNECTION_LIST_SIZE == WIIMOTE_STATS_CONNECTIONS, "wiimote_stats_t.connection mirrors connection_list");
+static connection_t connection_list[CONNECTION_LIST_SIZE];
+static uint8_t connection_index[0x1000]; // 1 + index into connection_list, 0 = none
+
+// Latest state of each connection for get_state(), written only by handle(). Two seqlocked buffers:
+// the writer fills the one readers are not pointed at, so a reader retries only if it is lapped.
+// The buffer carries its connection handle, so readers find it without connection_index.
+struct state_buffer_t {
+  std::atomic<uint32_t> seq; // odd while being written
+  uint16_t connection_handle; // 0 = slot unused
+  wiimote_state_t state;
+};
+struct state_snapshot_t {
+  std::atomic<uint32_t> latest; // index into buffer
+  state_buffer_t buffer[2];
+};
+static state_snapshot_t state_list[CONNECTION_LIST_SIZE]; // same index as connection_list
+
+// Publishes an empty state for connection_handle (0 when the slot is freed).
+static void state_reset(state_snapshot_t *snapshot, uint16_t connection_handle){
+  uint32_t latest = snapshot->latest.load(std::memory_order_relaxed);
+  state_buffer_t *next = &snapshot->buffer[latest ^ 1];
+  uint32_t seq = next->seq.load(std::memory_order_relaxed);
+  next->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  next->connection_handle = connection_handle;
+  memset(&next->state, 0, sizeof(wiimote_state_t));
+  next->seq.store(seq + 2, std::memory_order_release);
+  snapshot->latest.store(latest ^ 1, std::memory_order_release);
+}
+
+static connection_t* connection_find(uint16_t connection_handle){
+  uint8_t i = connection_index[connection_handle & 0x0FFF];
+  return i == 0 ? NULL : &connection_list[i-1];
+}
+static connection_t* connection_add(uint16_t connection_handle){
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    return c;
+  }
+  for(int i=0; i<CONNECTION_LIST_SIZE; i++){
+    if(!connection_list[i].used){
+      c = &connection_list[i];
+      memset(c, 0, sizeof(connection_t));
+      c->used = true;
+      c->connection_handle = connection_handle;
+      state_reset(&state_list[i], connection_handle);
+      stats.connection[i].reports.store(0, std::memory_order_release);
+      stats.connection[i].handle.store(connection_handle, std::memory_order_release);
+      connection_index[connection_handle & 0x0FFF] = i + 1;
+      return c;
     }
   }
-  return -1;
+  stat_add(stats.alloc_failures);
+  return NULL;
 }
-static int l2cap_connection_find_by_local_cid(uint16_t connection_handle, uint16_t local_cid){
-  for(int i=0; i<l2cap_connection_size; i++){
-    l2cap_connection_t *c = &l2cap_connection_list[i];
-    if(connection_handle == c->connection_handle && local_cid == c->local_cid){
-      return i;
-    }
+static void memory_request_fail_all(connection_t *c);
+static void connection_remove(uint16_t connection_handle){
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    c->used = false;
+    connection_index[connection_handle & 0x0FFF] = 0;
+    state_reset(&state_list[c - connection_list], 0);
+    stats.connection[c - connection_list].handle.store(0, std::memory_order_relaxed);
+    memory_request_fail_all(c); // after removing, so the callbacks can't queue new requests
   }
-  return -1;
 }
-static int l2cap_connection_add(struct l2cap_connection_t l2cap_connection){
-  if(L2CAP_CONNECTION_LIST_SIZE == l2cap_connection_size){
-    return -1;
+static void connection_clear(void){
+  memset(connection_list, 0, sizeof(connection_list));
+  for(int i=0; i<CONNECTION_LIST_SIZE; i++){
+    state_reset(&state_list[i], 0);
+    stats.connection[i].handle.store(0, std::memory_order_relaxed);
   }
-  l2cap_connection_list[l2cap_connection_size++] = l2cap_connection;
-  return l2cap_connection_size;
+  memset(connection_index, 0, sizeof(connection_index));
 }
 
-static int l2cap_connection_remove_all(uint16_t handle){
-  int found=0;
-  for(int i=0; i<l2cap_connection_size; i++){
-  l2cap_connection_t *c = &l2cap_connection_list[i];
-  if(handle==c->connection_handle)
-    found++;
-  else
-    l2cap_connection_list[i-found] = l2cap_connection_list[i];
+static int l2cap_channel_of_psm(uint16_t psm){
+  switch(psm){
+    case PSM_HID_Control_11  : return L2CAP_CHANNEL_CONTROL;
+    case PSM_HID_Interrupt_13: return L2CAP_CHANNEL_INTERRUPT;
   }
-  if(found>0){
-    l2cap_connection_size-=found;
-    return l2cap_connection_size;
+  return -1;
+}
+static l2cap_connection_t* l2cap_connection_find_by_local_cid(uint16_t connection_handle, uint16_t local_cid){
+  connection_t *c = connection_find(connection_handle);
+  if(!c){
+    return NULL;
   }
-  else{
-    return -1;
+  for(int ch=0; ch<2; ch++){
+    if(c->l2cap[ch].psm != 0 && c->l2cap[ch].local_cid == local_cid){
+      return &c->l2cap[ch];
+    }
   }
-
+  return NULL;
 }
-
-static int l2cap_connection_remove(uint16_t handle, uint16_t local_cid, uint16_t remote_cid){
-  int found=0;
-  log_d("From l2cap connections(size:%d), removing: handle=%d, local_cid:%04x, remote_cid:%04x",l2cap_connection_size, handle, local_cid, remote_cid);
-  for(int i=0; i<l2cap_connection_size; i++){
-    l2cap_connection_t *c = &l2cap_connection_list[i];
-    if(handle==c->connection_handle && local_cid==c->local_cid && remote_cid==c->remote_cid)
-      found++;
-    else
-      l2cap_connection_list[i-found] = l2cap_connection_list[i];
-  }
-  if(found>0){
-    l2cap_connection_size-=found;
-    return l2cap_connection_size;
+static l2cap_connection_t* l2cap_connection_add(uint16_t connection_handle, struct l2cap_connection_t l2cap_connection){
+  connection_t *c = connection_add(connection_handle);
+  int ch = l2cap_channel_of_psm(l2cap_connection.psm);
+  if(!c || ch < 0){
+    return NULL;
   }
-  else{
-    return -1;
+  c->l2cap[ch] = l2cap_connection;
+  return &c->l2cap[ch];
+}
+static void l2cap_connection_remove_all(uint16_t connection_handle){
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    memset(c->l2cap, 0, sizeof(c->l2cap));
   }
-  
 }
-
-static void l2cap_connection_clear(void){
-  l2cap_connection_size = 0;
+static bool l2cap_connection_remove(uint16_t connection_handle, uint16_t local_cid, uint16_t remote_cid){
+  log_d("From l2cap connections, removing: handle=%d, local_cid:%04x, remote_cid:%04x", connection_handle, local_cid, remote_cid);
+  l2cap_connection_t *l2cap_connection = l2cap_connection_find_by_local_cid(connection_handle, local_cid);
+  if(!l2cap_connection || l2cap_connection->remote_cid != remote_cid){
+    return false;
+  }
+  memset(l2cap_connection, 0, sizeof(l2cap_connection_t));
+  return true;
 }
 
 /**
- * callback 
+ * Balance Board
+ * The calibration holds 0kg, 17kg and 34kg readings for each sensor. They are turned into one
+ * fixed-point segment per 17kg so a report converts with a multiply and a shift per sensor.
  */
-static void _notify_host_send_available(void){
+static void balance_segment_init(balance_segment_t *segment, uint16_t from, uint16_t to, uint16_t weight){
+  segment->base   = from;
+  segment->weight = weight;
+  segment->slope  = from < to ? ((uint32_t)17000 << 16) / (to - from) : 0;
 }
-
-static int _notify_host_recv(uint8_t *data, uint16_t len){
-  if(ESP_OK == _queue_data(_rx_queue, data, len)){
-    return ESP_OK;
-  }else{
-    return ESP_FAIL;
+static void balance_sensor_init(connection_t *c){
+  for(int pos=0; pos<4; pos++){
+    uint16_t *cal = c->balance_calibration;
+    balance_segment_init(&c->balance_sensor[pos].segment[0], cal[pos],   cal[pos+4],     0);
+    balance_segment_init(&c->balance_sensor[pos].segment[1], cal[pos+4], cal[pos+8], 17000);
   }
+  c->balance_calibrated = true;
+}
+static int32_t balance_sensor_convert(const balance_sensor_t *sensor, uint16_t value){
+  const balance_segment_t *segment = &sensor->segment[sensor->segment[1].base <= value];
+  if(value < segment->base){ // below 0kg
+    return 0;
+  }
+  uint32_t delta = value - segment->base;
+  return segment->weight + (int32_t)(((uint64_t)delta * segment->slope) >> 16); // 32x32->64 multiply
 }
 
-static const esp_vhci_host_callback_t callback = {
-  _notify_host_send_available,
-  _notify_host_recv
-};
-
-static void _reset(void){
-  uint16_t len = make_cmd_reset(tmp_data);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return 
-  log_d("queued reset.");
+// 0xA40024: 0 kg, 17 kg, 34 kg; each Top Right, Bottom Right, Top Left, Bottom Left
+static void balance_calibration_init(connection_t *c, const uint8_t *data){
+  for(int i=0; i<12; i++){
+    c->balance_calibration[i] = data[i*2] * 256 + data[i*2+1];
+  }
+  balance_sensor_init(c);
+  memcpy(balance_calibration, c->balance_calibration, sizeof(balance_calibration)); // last calibrated board, for get_balance_weight(data, weight)
 }
 
-static void _scan_start(){
-  scanned_device_clear();
-  uint8_t timeout = 10; //0x30;
-  uint16_t len = make_cmd_inquiry(tmp_data, 0x9E8B33, timeout, 0x00);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-  log_d("queued inquiry.");
+static int32_t balance_median3(int32_t a, int32_t b, int32_t c){
+  int32_t lo = a < b ? a : b;
+  int32_t hi = a < b ? b : a;
+  return c < lo ? lo : hi < c ? hi : c;
 }
 
-static void _scan_stop(){
-  uint16_t len = make_cmd_inquiry_cancel(tmp_data);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-  log_d("queued inquiry_cancel.");
+// Share of half the sensor spacing, in 0.1 mm from the center.
+static int16_t balance_cop_axis(int32_t difference, int32_t total, int32_t span){
+  int32_t half = span / 2;
+  int32_t cop = (int32_t)((int64_t)difference * half / total);
+  return cop < -half ? -half : half < cop ? half : cop;
 }
 
-static void process_command_complete_event(uint8_t len, uint8_t* data){
-  if(data[1]==0x03 && data[2]==0x0C){ // reset
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("reset OK.");
-      uint16_t len = make_cmd_read_bd_addr(tmp_data);
-      _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-      log_d("queued read_bd_addr.");
-    }else{
-      log_d("reset failed.");
-    }
-  }else
-  if(data[1]==0x09 && data[2]==0x10){ // read_bd_addr
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("read_bd_addr OK. BD_ADDR=%s", formatHex(data+4, 6));
-
-      char name[] = "ESP32-BT-L2CAP";
-      log_d("sizeof(name)=%d", sizeof(name));
-      uint16_t len = make_cmd_write_local_name(tmp_data, (uint8_t*)name, sizeof(name));
-      _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-      log_d("queued write_local_name.");
-    }else{
-      log_d("read_bd_addr failed.");
-    }
-  }else
-  if(data[1]==0x13 && data[2]==0x0C){ // write_local_name
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("write_local_name OK.");
-      uint8_t cod[3] = {0x04, 0x05, 0x00};
-      uint16_t len = make_cmd_write_class_of_device(tmp_data, cod);
-      _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-      log_d("queued write_class_of_device.");
-    }else{
-      log_d("write_local_name failed.");
-    }
-  }else
-  if(data[1]==0x24 && data[2]==0x0C){ // write_class_of_device
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("write_class_of_device OK.");
-      uint16_t len = make_cmd_write_scan_enable(tmp_data, 3);
-      _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-      log_d("queued write_scan_enable.");
-    }else{
-      log_d("write_class_of_device failed.");
+// Converts, filters and tares the sensors of a 0x34 report, then derives the total and center of pressure.
+// ext holds TR BR TL BL, the order of balance_position_type_t.
+static void balance_process(connection_t *c, const uint8_t *ext, wiimote_report_t *report){
+  balance_filter_t *f = &c->balance_filter;
+  int32_t total = 0;
+  for(int pos=0; pos<4; pos++){
+    int32_t raw = balance_sensor_convert(&c->balance_sensor[pos], ext[pos*2] << 8 | ext[pos*2+1]);
+    int32_t *history = f->history[pos];
+    if(!f->primed){
+      history[0] = history[1] = history[2] = raw;
     }
-  }else
-  if(data[1]==0x1A && data[2]==0x0C){ // write_scan_enable
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("write_scan_enable OK.");
-      _singleton->_callback(WIIMOTE_EVENT_INITIALIZE, 0, NULL, 0);
+    history[f->history_index] = raw;
+    int32_t value = (f->median ? balance_median3(history[0], history[1], history[2]) : raw) * (1 << BALANCE_FRACTION_BITS);
+    if(f->primed && f->smoothing){
+      f->filtered[pos] += (value - f->filtered[pos]) >> f->smoothing;
     }else{
-      log_d("write_scan_enable failed.");
+      f->filtered[pos] = value;
     }
-  }else
-  if(data[1]==0x02 && data[2]==0x04){ // inquiry_cancel
-    // data[0] Num_HCI_Command_Packets
-    if(data[3]==0x00){ // OK
-      log_d("inquiry_cancel OK.");
-    }else{
-      log_d("inquiry_cancel failed.");
+    report->weight[pos] = (f->filtered[pos] - f->tare[pos]) >> BALANCE_FRACTION_BITS;
+    total += report->weight[pos];
+  }
+  f->history_index = f->history_index == 2 ? 0 : f->history_index + 1;
+  f->primed = true;
+
+  // an empty board reads near zero: let the tare follow its drift, about 1/128 per report
+  if(f->zero_tracking && -WIIMOTE_BALANCE_COP_MIN_WEIGHT < total && total < WIIMOTE_BALANCE_COP_MIN_WEIGHT){
+    for(int pos=0; pos<4; pos++){
+      f->tare[pos] += (f->filtered[pos] - f->tare[pos]) >> 7;
     }
-  }else{
-    log_d("### process_command_complete_event no impl ###");
+  }
+
+  report->has_weight = true;
+  report->total_weight = total;
+  if(WIIMOTE_BALANCE_COP_MIN_WEIGHT <= total){
+    const int32_t *w = report->weight;
+    report->has_cop = true;
+    report->cop[0] = balance_cop_axis((w[BALANCE_POSITION_TOP_RIGHT] + w[BALANCE_POSITION_BOTTOM_RIGHT]) - (w[BALANCE_POSITION_TOP_LEFT] + w[BALANCE_POSITION_BOTTOM_LEFT]), total, WIIMOTE_BALANCE_WIDTH);
+    report->cop[1] = balance_cop_axis((w[BALANCE_POSITION_TOP_RIGHT] + w[BALANCE_POSITION_TOP_LEFT]) - (w[BALANCE_POSITION_BOTTOM_RIGHT] + w[BALANCE_POSITION_BOTTOM_LEFT]), total, WIIMOTE_BALANCE_LENGTH);
   }
 }
 
-static void process_command_status_event(uint8_t len, uint8_t* data){
-  if(data[2]==0x01 && data[3]==0x04){ // inquiry
-    // data[1] Num_HCI_Command_Packets
-    if(data[0]==0x00){ // 0x00=pending
-      log_d("inquiry pending!");
-      _singleton->_callback(WIIMOTE_EVENT_SCAN_START, 0, NULL, 0);
-    }else{
-      log_d("inquiry failed. error=%02X", data[0]);
-    }
-  }else
-  if(data[2]==0x19 && data[3]==0x04){
-    // data[1] Num_HCI_Command_Packets
-    if(data[0]==0x00){ // 0x00=pending
-      log_d("remote_name_request pending!");
-    }else{
-      log_d("remote_name_request failed. error=%02X", data[0]);
-    }
-  }else
-  if(data[2]==0x05 && data[3]==0x04){
-    // data[1] Num_HCI_Command_Packets
-    if(data[0]==0x00){ // 0x00=pending
-      log_d("create_connection pending!");
-    }else{
-      log_d("create_connection failed. error=%02X", data[0]);
+/**
+ * Memory requests
+ * Reads answer with 0x21 reports of up to 16 bytes (SE: size-1, error), writes with a 0x22 ack for report 0x16.
+ * Neither names the request, so answers are matched to the oldest outstanding read or write.
+ */
+static memory_request_t* memory_request_add(connection_t *c){
+  if(c->memory_request_list_size == MEMORY_REQUEST_LIST_SIZE){
+    return NULL;
+  }
+  memory_request_t *request = &c->memory_request_list[c->memory_request_list_size++];
+  memset(request, 0, sizeof(memory_request_t));
+  request->active = esp_timer_get_time();
+  return request;
+}
+static memory_request_t* memory_request_find(connection_t *c, bool write){
+  for(int i=0; i<c->memory_request_list_size; i++){
+    if(c->memory_request_list[i].write == write){
+      return &c->memory_request_list[i];
     }
-  }else{
-      log_d("### process_command_status_event no impl ###");
   }
+  return NULL;
 }
-
-static void process_inquiry_result_event(uint8_t len, uint8_t* data){
-  uint8_t num = data[0];
-  //log_d("inquiry_result num=%d", num);
-
-  for(int i=0; i<num; i++){
-    int pos = 1 + (6+1+2+3+2) * i;
-
-    struct bd_addr_t bd_addr;
-    STREAM_TO_BDADDR(bd_addr.addr, data+pos);
-
-    // uint8_t ignore[] = {0x54, 0x13, 0x79, 0x31, 0x3E, 0x5A};
-    // if(memcmp(&bd_addr.addr, &ignore, 6)==0){ continue; }
-
-    log_d("**** inquiry_result BD_ADDR(%d/%d) = %s", i, num, formatHex((uint8_t*)&bd_addr.addr, BD_ADDR_LEN));
-
-    int idx = scanned_device_find(&bd_addr);
-    if(idx == -1){
-      log_d("    Page_Scan_Repetition_Mode = %02X", data[pos+6]);
-      // data[pos+7] data[pos+8] // Reserved
-      log_d("    Class_of_Device = %02X %02X %02X", data[pos+9], data[pos+10], data[pos+11]);
-      log_d("    Clock_Offset = %02X %02X", data[pos+12], data[pos+13]);
-
-      struct scanned_device_t scanned_device;
-      scanned_device.bd_addr = bd_addr;
-      scanned_device.psrm    = data[pos+6];
-      scanned_device.clkofs  = ((0x80 | data[pos+12]) << 8) | (data[pos+13]);
-
-      idx = scanned_device_add(scanned_device);
-      if(0<=idx){
-        if(data[pos+9]==0x04 && data[pos+10]==0x25 && data[pos+11]==0x00){ // Filter for Wiimote [04 25 00] 
-          uint16_t len = make_cmd_remote_name_request(tmp_data, scanned_device.bd_addr, scanned_device.psrm, scanned_device.clkofs);
-          _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-          log_d("queued remote_name_request.");
-        }else{
-          log_d("skiped to remote_name_request. (not Wiimote COD)");
-        }
-      }else{
-        log_d("failed to scanned_device_add.");
-      }
-    }else{
-      log_d(" (dup idx=%d)", idx);
+static void memory_request_complete(connection_t *c, memory_request_t *request){
+  memory_request_t done = *request;
+  int i = request - c->memory_request_list;
+  memmove(request, request + 1, sizeof(memory_request_t) * (c->memory_request_list_size - i - 1));
+  c->memory_request_list_size--;
+  if(done.callback){
+    done.callback(c->connection_handle, done.error, done.write ? NULL : done.buffer, done.size, done.ctx);
+  }
+}
+static void memory_request_fail_all(connection_t *c){
+  while(0 < c->memory_request_list_size){
+    c->memory_request_list[0].error = WIIMOTE_MEMORY_DISCONNECTED;
+    memory_request_complete(c, &c->memory_request_list[0]);
+  }
+}
+// Fails the requests the remote stopped answering, so callers waiting on them (extension_query) carry on.
+static void memory_request_expire(connection_t *c, int64_t now){
+  for(int i=0; i<c->memory_request_list_size; ){
+    memory_request_t *request = &c->memory_request_list[i];
+    if(now - request->active < MEMORY_REQUEST_TIMEOUT){
+      i++;
+      continue;
     }
+    log_e("memory %s %06X timed out", request->write ? "write" : "read", (unsigned)request->offset);
+    request->error = WIIMOTE_MEMORY_TIMEOUT;
+    memory_request_complete(c, request);
+    i = 0; // the callback may have queued requests
   }
 }
 
-static void process_inquiry_complete_event(uint8_t len, uint8_t* data){
-  uint8_t status = data[0];
-  log_d("inquiry_complete status=%02X", status);
-  _singleton->_callback(WIIMOTE_EVENT_SCAN_STOP, 0, NULL, 0);
+// (a1) 21 BB BB SE FF FF DD*16
+static void process_memory_read_data(connection_t *c, uint8_t *data, uint16_t len){
+  memory_request_t *request = memory_request_find(c, false);
+  if(!request || len < 7){
+    log_d("!!! unexpected read data");
+    return;
+  }
+  uint8_t size  = (data[4] >> 4) + 1;
+  uint8_t error = data[4] & 0x0F;
+  uint16_t offset = data[5] << 8 | data[6];
+  if(error != 0){
+    request->error = error;
+    memory_request_complete(c, request);
+    return;
+  }
+  if(offset != ((request->offset + request->done) & 0xFFFF) || len < 7 + size){
+    // answers come in order, so the rest of this read is lost: fail it rather than wait for data that won't come
+    log_d("!!! read data offset=%04X, expected %04X", offset, (request->offset + request->done) & 0xFFFF);
+    request->error = WIIMOTE_MEMORY_MISMATCH;
+    memory_request_complete(c, request);
+    return;
+  }
+  if(request->size - request->done < size){
+    size = request->size - request->done;
+  }
+  memcpy(request->buffer + request->done, data + 7, size);
+  request->done += size;
+  request->active = esp_timer_get_time();
+  if(request->done == request->size){
+    memory_request_complete(c, request);
+  }
 }
 
-static void process_remote_name_request_complete_event(uint8_t len, uint8_t* data){
-  uint8_t status = data[0];
-  log_d("remote_name_request_complete status=%02X", status);
-  struct bd_addr_t bd_addr;
-  STREAM_TO_BDADDR(bd_addr.addr, data+1);
-  log_d("  BD_ADDR = %s", formatHex((uint8_t*)&bd_addr.addr, BD_ADDR_LEN));
-
-  char* name = (char*)(data+7);
-  log_d("  REMOTE_NAME = %s", name);
+// (a1) 22 BB BB RR EE
+static void process_memory_write_ack(connection_t *c, uint8_t *data, uint16_t len){
+  if(len < 6 || data[4] != 0x16){
+    return;
+  }
+  memory_request_t *request = memory_request_find(c, true);
+  if(!request){
+    log_d("!!! unexpected write ack");
+    return;
+  }
+  if(request->error == 0){
+    request->error = data[5];
+  }
+  request->active = esp_timer_get_time();
+  if(++request->done == request->chunks){
+    memory_request_complete(c, request);
+  }
+}
 
-  int idx = scanned_device_find(&bd_addr);
-  if(0<=idx && (strcmp("Nintendo RVL-CNT-01", name)==0 || strcmp("Nintendo RVL-WBC-01", name)==0)){
-    struct scanned_device_t scanned_device = scanned_device_list[idx];
-    struct requested_connection_t requested_connection;
-    requested_connection.bd_addr = bd_addr;
-    requested_connection_add(requested_connection);
+/**
+ * Accelerometer
+ * EEPROM 0x16: zero point X Y Z, their low bits, 1g point X Y Z, their low bits, volume, checksum.
+ * https://wiibrew.org/wiki/Wiimote#Accelerometer
+ */
+#define ACCEL_CALIBRATION_ADDRESS 0x0016
+#define ACCEL_CALIBRATION_SIZE    10
 
-    uint16_t pt = 0x0008;
-    uint8_t ars = 0x00;
-    uint16_t len = make_cmd_create_connection(tmp_data, scanned_device.bd_addr, pt, scanned_device.psrm, scanned_device.clkofs, ars);
-    _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-    log_d("queued create_connection.");
+static bool accel_calibration_init(connection_t *c, const uint8_t *cal){
+  uint8_t sum = 0x55;
+  for(int i=0; i<9; i++){
+    sum += cal[i];
+  }
+  if(sum != cal[9]){
+    log_d("!!! accelerometer calibration checksum %02X != %02X", sum, cal[9]);
+    return false;
+  }
+  for(int axis=0; axis<3; axis++){
+    int shift = 4 - axis * 2; // low bits: --XXYYZZ
+    uint16_t zero = cal[axis  ] << 2 | (cal[3] >> shift & 0x03);
+    uint16_t one  = cal[axis+4] << 2 | (cal[7] >> shift & 0x03);
+    if(one < zero + 32){ // less than 32 counts/g would overflow int16_t mg
+      log_d("!!! accelerometer calibration axis=%d zero=%d 1g=%d", axis, zero, one);
+      return false;
+    }
+    c->accel_calibration.zero[axis]  = zero;
+    c->accel_calibration.scale[axis] = ((int32_t)1000 << 16) / (one - zero);
+  }
+  c->accel_calibrated = true;
+  return true;
+}
+static void accel_convert(const accel_calibration_t *cal, const uint16_t *accel, int16_t *mg){
+  for(int axis=0; axis<3; axis++){
+    mg[axis] = (int16_t)(((int32_t)(accel[axis] - cal->zero[axis]) * cal->scale[axis]) >> 16);
   }
 }
 
-static void _l2cap_connect(uint16_t connection_handle, uint16_t psm, uint16_t source_cid){
-  uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
+/**
+ * IR camera
+ * Blob coordinates are 10 bits: 8 low bits in their own byte, the 2 high bits packed into a shared byte.
+ * https://wiibrew.org/wiki/Wiimote#IR_Camera
+ */
+static const uint8_t ir_sensitivity_blocks[5][11] = {
+  { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0x64, 0x00, 0xFE,   0xFD, 0x05 }, // level 1
+  { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0x96, 0x00, 0xB4,   0xB3, 0x04 }, // level 2
+  { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xAA, 0x00, 0x64,   0x63, 0x03 }, // level 3
+  { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xC8, 0x00, 0x36,   0x35, 0x03 }, // level 4
+  { 0x07, 0x00, 0x00, 0x71, 0x01, 0x00, 0x72, 0x00, 0x20,   0x1F, 0x03 }, // level 5
+};
+
+// basic: X1 Y1 (Y1,X1,Y2,X2 high bits) X2 Y2, two pairs in 10 bytes
+static void ir_decode_basic(const uint8_t *ir, wiimote_ir_blob_t *blobs){
+  for(int i=0; i<2; i++, ir+=5, blobs+=2){
+    blobs[0].x = ir[0] | (ir[2] << 4 & 0x300);
+    blobs[0].y = ir[1] | (ir[2] << 2 & 0x300);
+    blobs[1].x = ir[3] | (ir[2] << 8 & 0x300);
+    blobs[1].y = ir[4] | (ir[2] << 6 & 0x300);
+    blobs[0].size = blobs[1].size = 0;
+    blobs[0].intensity = blobs[1].intensity = 0;
+  }
+}
+// extended: X Y (Y,X high bits, size), stride 3 for extended or 9 for full
+static void ir_decode_extended(const uint8_t *ir, int stride, int count, wiimote_ir_blob_t *blobs){
+  for(int i=0; i<count; i++, ir+=stride){
+    blobs[i].x    = ir[0] | (ir[2] << 4 & 0x300);
+    blobs[i].y    = ir[1] | (ir[2] << 2 & 0x300);
+    blobs[i].size = ir[2] & 0x0F;
+    blobs[i].intensity = stride == 9 ? ir[8] : 0;
+  }
+}
+
+static void ir_decode(connection_t *c, wiimote_report_t *report){
+  switch(report->id){
+    case 0x36: case 0x37: ir_decode_basic(report->ir, c->ir_blobs); break;
+    case 0x33: ir_decode_extended(report->ir, 3, 4, c->ir_blobs);   break;
+    case 0x3E: ir_decode_extended(report->ir, 9, 2, c->ir_blobs);   break; // blobs 0, 1
+    case 0x3F: ir_decode_extended(report->ir, 9, 2, c->ir_blobs+2); break; // blobs 2, 3
+    default: return;
+  }
+  report->ir_blobs = c->ir_blobs;
+
+  // two strongest tracked blobs, by size (basic mode has no size, so the first two win)
+  int first = -1, second = -1;
+  int first_key = 0, second_key = 0;
+  for(int i=0; i<4; i++){
+    int key = c->ir_blobs[i].y < 1023 ? c->ir_blobs[i].size + 1 : 0;
+    if(first_key < key){
+      second = first; second_key = first_key;
+      first = i; first_key = key;
+    }else if(second_key < key){
+      second = i; second_key = key;
+    }
+  }
+  if(first < 0){
+    return;
+  }
+  const wiimote_ir_blob_t *a = &c->ir_blobs[first];
+  const wiimote_ir_blob_t *b = &c->ir_blobs[second < 0 ? first : second];
+  report->has_pointer = true;
+  report->pointer[0] = 1023 - ((a->x + b->x) >> 1); // the camera sees the scene mirrored
+  report->pointer[1] = (a->y + b->y) >> 1;
+}
+
+/**
+ * Device cache
+ * What identification and calibration found out about a remote, kept in NVS under its bd_addr. A returning
+ * remote is configured from it at connection time; the queries still run and rewrite the entry on a change.
+ * Writes are queued and done by device_cache_flush() at the end of a handle() call (either variant) that
+ * leaves the RX ring empty, so a flash write never holds up packet processing. The "devices" blob lists the
+ * remotes with an entry, least recently connected first; the oldest entry is erased to keep at most
+ * DEVICE_CACHE_LIST_SIZE.
+ */
+#define DEVICE_CACHE_NAMESPACE "wiimote"
+#define DEVICE_CACHE_VERSION   1
+#define DEVICE_CACHE_LIST_SIZE 8
+#define DEVICE_CACHE_INDEX_NVS_KEY "devices"
+
+static bd_addr_t device_cache_index[DEVICE_CACHE_LIST_SIZE]; // oldest first
+static bd_addr_lru_t device_cache_lru = BD_ADDR_LRU(device_cache_index);
+static bool device_cache_index_loaded = false;
+static bool device_cache_index_dirty = false;
+
+struct device_cache_pending_t {
+  bd_addr_t bd_addr;
+  device_cache_t cache;
+};
+static device_cache_pending_t device_cache_pending[DEVICE_CACHE_LIST_SIZE];
+static int device_cache_pending_size = 0;
+
+static void device_cache_key(const bd_addr_t *bd_addr, char *key){
+  for(int i=0; i<BD_ADDR_LEN; i++){
+    sprintf(key + i*2, "%02X", bd_addr->addr[i]);
+  }
+}
+
+static void device_cache_index_load(void){
+  if(device_cache_index_loaded){
+    return;
+  }
+  device_cache_index_loaded = true;
+  nvs_handle_t nvs;
+  if(nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK){
+    return;
+  }
+  size_t len = sizeof(device_cache_index);
+  if(nvs_get_blob(nvs, DEVICE_CACHE_INDEX_NVS_KEY, device_cache_index, &len) == ESP_OK && len % sizeof(bd_addr_t) == 0){
+    device_cache_lru.size = len / sizeof(bd_addr_t);
+  }
+  nvs_close(nvs);
+}
+static int device_cache_index_find(const bd_addr_t *bd_addr){
+  device_cache_index_load();
+  return bd_addr_lru_find(&device_cache_lru, bd_addr);
+}
+// makes the remote the most recently connected one
+static void device_cache_index_touch(int i){
+  if(i == device_cache_lru.size - 1){
+    return;
+  }
+  bd_addr_lru_touch(&device_cache_lru, i);
+  device_cache_index_dirty = true;
+}
+
+static device_cache_pending_t* device_cache_pending_find(const bd_addr_t *bd_addr){
+  for(int i=0; i<device_cache_pending_size; i++){
+    if(memcmp(bd_addr->addr, device_cache_pending[i].bd_addr.addr, BD_ADDR_LEN) == 0){
+      return &device_cache_pending[i];
+    }
+  }
+  return NULL;
+}
+
+// Loads the entry of the remote and applies it.
+static void device_cache_restore(connection_t *c){
+  char key[BD_ADDR_LEN*2 + 1];
+  device_cache_key(&c->bd_addr, key);
+  device_cache_t cache;
+  const device_cache_pending_t *pending = device_cache_pending_find(&c->bd_addr);
+  if(pending){ // reconnected before it was written
+    cache = pending->cache;
+  }else{
+    nvs_handle_t nvs;
+    if(nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK){
+      return; // nothing stored yet
+    }
+    size_t len = sizeof(cache);
+    esp_err_t err = nvs_get_blob(nvs, key, &cache, &len);
+    nvs_close(nvs);
+    if(err != ESP_OK || len != sizeof(cache) || cache.version != DEVICE_CACHE_VERSION){
+      return;
+    }
+    int i = device_cache_index_find(&c->bd_addr);
+    if(0 <= i){
+      device_cache_index_touch(i);
+    }
+  }
+  c->cache = cache;
+  c->cache_loaded = true;
+  c->extension = (extension_type_t)cache.extension;
+  if(cache.accel_calibrated){
+    accel_calibration_init(c, cache.accel_calibration_data);
+  }
+  if(cache.balance_calibrated){
+    balance_calibration_init(c, cache.balance_calibration_data);
+  }
+  log_d("device cache %s: extension=%d accel=%d balance=%d", key, cache.extension, cache.accel_calibrated, cache.balance_calibrated);
+}
+
+// Queues the entry for device_cache_flush() if it differs from what is stored.
+static void device_cache_update(connection_t *c, device_cache_t *cache){
+  cache->version = DEVICE_CACHE_VERSION;
+  if(c->cache_loaded && memcmp(cache, &c->cache, sizeof(device_cache_t)) == 0){
+    return;
+  }
+  c->cache = *cache;
+  c->cache_loaded = true;
+
+  device_cache_pending_t *pending = device_cache_pending_find(&c->bd_addr);
+  if(!pending){
+    if(device_cache_pending_size == DEVICE_CACHE_LIST_SIZE){
+      log_e("device cache queue full, entry not stored");
+      return;
+    }
+    pending = &device_cache_pending[device_cache_pending_size++];
+    pending->bd_addr = c->bd_addr;
+  }
+  pending->cache = *cache;
+}
+
+// Writes the queued entries and the index. Called from handle() with no packet waiting.
+static void device_cache_flush(void){
+  if(device_cache_pending_size == 0 && !device_cache_index_dirty){
+    return;
+  }
+  device_cache_index_load();
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READWRITE, &nvs);
+  if(err != ESP_OK){
+    log_e("device cache not stored: %s", esp_err_to_name(err));
+    device_cache_pending_size = 0;
+    device_cache_index_dirty = false;
+    return;
+  }
+  char key[BD_ADDR_LEN*2 + 1];
+  for(int p=0; p<device_cache_pending_size; p++){
+    const device_cache_pending_t *pending = &device_cache_pending[p];
+    int i = device_cache_index_find(&pending->bd_addr);
+    if(0 <= i){
+      device_cache_index_touch(i);
+    }else{
+      if(device_cache_lru.size == DEVICE_CACHE_LIST_SIZE){ // the least recently connected remote is evicted
+        device_cache_key(&device_cache_index[0], key);
+        nvs_erase_key(nvs, key);
+      }
+      bd_addr_lru_add(&device_cache_lru, &pending->bd_addr);
+      device_cache_index_dirty = true;
+    }
+    device_cache_key(&pending->bd_addr, key);
+    err = nvs_set_blob(nvs, key, &pending->cache, sizeof(device_cache_t));
+    if(err != ESP_OK){
+      log_e("device cache %s not stored: %s", key, esp_err_to_name(err));
+    }
+  }
+  device_cache_pending_size = 0;
+  if(device_cache_index_dirty){
+    err = nvs_set_blob(nvs, DEVICE_CACHE_INDEX_NVS_KEY, device_cache_index, sizeof(bd_addr_t) * device_cache_lru.size);
+    if(err != ESP_OK){
+      log_e("device cache index not stored: %s", esp_err_to_name(err));
+    }
+    device_cache_index_dirty = false;
+  }
+  err = nvs_commit(nvs);
+  nvs_close(nvs);
+  if(err != ESP_OK){
+    log_e("device cache not committed: %s", esp_err_to_name(err));
+  }
+}
+
+// Drops the entry of the remote, queued or stored. Not for the packet path: it writes to flash right away.
+static void device_cache_forget(const bd_addr_t *bd_addr){
+  device_cache_pending_t *pending = device_cache_pending_find(bd_addr);
+  if(pending){
+    int p = pending - device_cache_pending;
+    memmove(pending, pending + 1, sizeof(device_cache_pending_t) * (device_cache_pending_size - p - 1));
+    device_cache_pending_size--;
+  }
+  int i = device_cache_index_find(bd_addr);
+  if(0 <= i){
+    bd_addr_lru_remove(&device_cache_lru, i);
+    device_cache_index_dirty = true;
+  }
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READWRITE, &nvs);
+  if(err != ESP_OK){
+    return;
+  }
+  char key[BD_ADDR_LEN*2 + 1];
+  device_cache_key(bd_addr, key);
+  nvs_erase_key(nvs, key);
+  nvs_close(nvs);
+  device_cache_flush(); // the index
+}
+
+static void device_cache_update_extension(connection_t *c){
+  device_cache_t cache = c->cache;
+  cache.extension = c->extension;
+  device_cache_update(c, &cache);
+}
+
+/**
+ * Link key store
+ * Keys from Link Key Notification, answered to the controller's Link Key Request so a paired remote
+ * reconnects without the PIN exchange. The list is one NVS blob, loaded on first use; when it is full
+ * the oldest key is replaced. Changes made while processing HCI events are written by link_key_flush() along
+ * with the device cache; forget() and clear_link_keys() write right away.
+ */
+struct link_key_t {
+  bd_addr_t bd_addr;
+  uint8_t key[LINK_KEY_LEN];
+  uint8_t type;
+};
+#define LINK_KEY_LIST_SIZE 8
+#define LINK_KEY_LIST_NVS_KEY "link_keys"
+static link_key_t link_key_list[LINK_KEY_LIST_SIZE]; // oldest first
+static bd_addr_lru_t link_key_lru = BD_ADDR_LRU(link_key_list);
+static_assert(offsetof(link_key_t, bd_addr) == 0, "bd_addr_lru_t entries start with their bd_addr");
+static bool link_key_list_loaded = false;
+static bool link_key_list_dirty = false;
+
+static void link_key_load(void){
+  if(link_key_list_loaded){
+    return;
+  }
+  link_key_list_loaded = true;
+  nvs_handle_t nvs;
+  if(nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK){
+    return;
+  }
+  size_t len = sizeof(link_key_list);
+  if(nvs_get_blob(nvs, LINK_KEY_LIST_NVS_KEY, link_key_list, &len) == ESP_OK && len % sizeof(link_key_t) == 0){
+    link_key_lru.size = len / sizeof(link_key_t);
+  }
+  nvs_close(nvs);
+  log_d("%d link keys loaded", link_key_lru.size);
+}
+static void link_key_save(void){
+  link_key_list_dirty = false;
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(DEVICE_CACHE_NAMESPACE, NVS_READWRITE, &nvs);
+  if(err == ESP_OK){
+    err = nvs_set_blob(nvs, LINK_KEY_LIST_NVS_KEY, link_key_list, sizeof(link_key_t) * link_key_lru.size);
+    if(err == ESP_OK){
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if(err != ESP_OK){
+    log_e("link keys not stored: %s", esp_err_to_name(err));
+  }
+}
+// Called from handle() with no packet waiting.
+static void link_key_flush(void){
+  if(link_key_list_dirty){
+    link_key_save();
+  }
+}
+static link_key_t* link_key_find(const bd_addr_t *bd_addr){
+  link_key_load();
+  int i = bd_addr_lru_find(&link_key_lru, bd_addr);
+  return i < 0 ? NULL : &link_key_list[i];
+}
+static bool link_key_remove(const bd_addr_t *bd_addr){
+  link_key_t *entry = link_key_find(bd_addr);
+  if(!entry){
+    return false;
+  }
+  bd_addr_lru_remove(&link_key_lru, entry - link_key_list);
+  return true;
+}
+// adds the key as the newest entry, replacing an older key of the remote
+static void link_key_add(const bd_addr_t *bd_addr, const uint8_t *key, uint8_t type){
+  link_key_load();
+  link_key_t *entry = (link_key_t*)bd_addr_lru_add(&link_key_lru, bd_addr);
+  memcpy(entry->key, key, LINK_KEY_LEN);
+  entry->type = type;
+  link_key_list_dirty = true;
+}
+
+/**
+ * ACL flow control
+ * The controller has acl_total_packets ACL buffers shared by all links. A credit is taken for each
+ * ACL packet sent and returned by the Number Of Completed Packets event (or when the link goes away).
+ * Each link may hold only its share of them, so a remote that stops completing packets can't take
+ * every buffer and stall the others.
+ */
+static uint16_t acl_data_packet_length = 0;
+static uint16_t acl_total_packets = 0; // 0 until Read Buffer Size completes: not limited
+static uint16_t acl_credits = 0;
+
+static void acl_credit_release_link(connection_t *c){
+  // the controller flushes the packets of a closed link, so their buffers are free again
+  acl_credits = acl_total_packets < acl_credits + c->acl_outstanding ? acl_total_packets : acl_credits + c->acl_outstanding;
+  c->acl_outstanding = 0;
+}
+
+static bool acl_credit_available(uint16_t connection_handle){
+  if(acl_total_packets == 0){
+    return true;
+  }
+  if(acl_credits == 0){
+    return false;
+  }
+  connection_t *c = connection_find(connection_handle);
+  if(!c){
+    return true;
+  }
+  int links = 0;
+  for(int i=0; i<CONNECTION_LIST_SIZE; i++){
+    links += connection_list[i].used;
+  }
+  uint16_t share = acl_total_packets / links;
+  return c->acl_outstanding < (share == 0 ? 1 : share);
+}
+static void acl_credit_take(uint16_t connection_handle){
+  if(acl_total_packets == 0){
+    return;
+  }
+  acl_credits--;
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    c->acl_outstanding++;
+  }
+}
+static void acl_credit_return(uint16_t connection_handle, uint16_t count){
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    c->acl_outstanding -= count < c->acl_outstanding ? count : c->acl_outstanding;
+  }
+  acl_credits = acl_total_packets < acl_credits + count ? acl_total_packets : acl_credits + count;
+}
+
+/**
+ * callback 
+ */
+static void _notify_host_send_available(void){
+}
+
+static int _notify_host_recv(uint8_t *data, uint16_t len){
+  lendata_t *lendata = lendata_ring_reserve(&_rx_ring, len);
+  if(!lendata){
+    stat_add(stats.rx_dropped);
+    return ESP_FAIL;
+  }
+  lendata->len = len;
+  lendata->timestamp = esp_timer_get_time();
+  memcpy(lendata->data, data, len);
+  _capture(true, data, len, lendata->timestamp);
+  lendata_ring_commit(&_rx_ring, lendata);
+  stat_add(stats.rx_packets);
+  stat_add(stats.rx_bytes, len);
+  stat_max(stats.rx_high_water, lendata_ring_count(&_rx_ring));
+  return ESP_OK;
+}
+
+static const esp_vhci_host_callback_t callback = {
+  _notify_host_send_available,
+  _notify_host_recv
+};
+
+/**
+ * HCI command scheduler
+ * Commands are sent while the controller grants Num_HCI_Command_Packets credits. Each sent command is
+ * kept in hci_command_list with its completion handler until its Command Complete/Status event arrives,
+ * or until HCI_COMMAND_TIMEOUT, when the handler gets HCI_STATUS_TIMEOUT and the credit is given back.
+ */
+#define HCI_COMMAND_TIMEOUT 2000000 // microseconds
+#define HCI_STATUS_TIMEOUT  0xFF    // not an HCI error code: no Command Complete/Status arrived
+static uint8_t hci_command_credits = 1;
+struct hci_command_t {
+  uint16_t opcode;
+  hci_command_complete_t complete;
+  int64_t sent; // esp_timer microseconds
+};
+static int hci_command_list_size = 0;
+#define HCI_COMMAND_LIST_SIZE 8
+static hci_command_t hci_command_list[HCI_COMMAND_LIST_SIZE];
+static int hci_command_add(struct hci_command_t hci_command){
+  if(HCI_COMMAND_LIST_SIZE == hci_command_list_size){
+    return -1;
+  }
+  hci_command_list[hci_command_list_size++] = hci_command;
+  return hci_command_list_size;
+}
+// removes the oldest outstanding command with the opcode
+static bool hci_command_remove(uint16_t opcode, struct hci_command_t *hci_command){
+  for(int i=0; i<hci_command_list_size; i++){
+    if(opcode == hci_command_list[i].opcode){
+      *hci_command = hci_command_list[i];
+      for(int j=i+1; j<hci_command_list_size; j++){
+        hci_command_list[j-1] = hci_command_list[j];
+      }
+      hci_command_list_size--;
+      return true;
+    }
+  }
+  return false;
+}
+static void hci_command_clear(void){
+  hci_command_list_size = 0;
+  hci_command_credits = 1;
+}
+// fails the commands whose event did not come, oldest first
+static void hci_command_expire(int64_t now){
+  while(0 < hci_command_list_size && HCI_COMMAND_TIMEOUT <= now - hci_command_list[0].sent){
+    struct hci_command_t hci_command = hci_command_list[0];
+    hci_command_remove(hci_command.opcode, &hci_command);
+    log_e("hci command %04X timed out", hci_command.opcode);
+    if(hci_command_credits == 0){
+      hci_command_credits = 1;
+    }
+    if(hci_command.complete){
+      hci_command.complete(HCI_STATUS_TIMEOUT, NULL, 0);
+    }
+  }
+}
+
+/**
+ * Inquiry
+ * set_inquiry() parameters, applied by the next _scan_start(). The Inquiry Mode is written only when it changed.
+ */
+static uint8_t inquiry_length = 10; // x 1.28 s
+static uint8_t inquiry_max_responses = 0;
+static wiimote_inquiry_mode_t inquiry_mode = WIIMOTE_INQUIRY_RSSI;
+static int inquiry_mode_written = -1; // controller's mode, -1 = unknown (after reset)
+
+static void _init_command_complete(uint8_t status, uint8_t* data, uint8_t len);
+
+static uint8_t init_commands_pending = 0;
+static bool init_failed = false;
+
+static void _read_buffer_size_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // OK
+    acl_data_packet_length = (data[2] << 8) | data[1];
+    acl_total_packets      = (data[5] << 8) | data[4];
+    acl_credits            = acl_total_packets;
+    log_d("read_buffer_size OK. ACL_Data_Packet_Length=%d Total_Num_ACL_Data_Packets=%d", acl_data_packet_length, acl_total_packets);
+  }else{
+    log_d("read_buffer_size failed.");
+  }
+}
+
+static void _read_bd_addr_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // OK
+    log_d("read_bd_addr OK. BD_ADDR=%s", formatHex(data+1, 6));
+  }
+  _init_command_complete(status, data, len);
+}
+
+static void _init_command_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status!=0x00){
+    log_d("init command failed. status=%02X", status);
+    init_failed = true;
+  }
+  if(0 < init_commands_pending && --init_commands_pending == 0 && !init_failed){
+    _singleton->_callback(WIIMOTE_EVENT_INITIALIZE, 0, NULL, 0);
+  }
+}
+
+// The commands after reset do not depend on each other, so they are queued together and pipelined.
+static void _reset_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status!=0x00){
+    log_d("reset failed.");
+    return;
+  }
+  log_d("reset OK.");
+  inquiry_mode_written = -1;
+  init_commands_pending = 4;
+  init_failed = false;
+
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t cmd_len = make_cmd_read_buffer_size(buf);
+  tx_slot_commit(&_cmd_pool, cmd_len, _read_buffer_size_complete);
+
+  buf = tx_slot_acquire(&_cmd_pool);
+  cmd_len = make_cmd_read_bd_addr(buf);
+  tx_slot_commit(&_cmd_pool, cmd_len, _read_bd_addr_complete);
+
+  char name[] = "ESP32-BT-L2CAP";
+  buf = tx_slot_acquire(&_cmd_pool);
+  cmd_len = make_cmd_write_local_name(buf, (uint8_t*)name, sizeof(name));
+  tx_slot_commit(&_cmd_pool, cmd_len, _init_command_complete);
+
+  uint8_t cod[3] = {0x04, 0x05, 0x00};
+  buf = tx_slot_acquire(&_cmd_pool);
+  cmd_len = make_cmd_write_class_of_device(buf, cod);
+  tx_slot_commit(&_cmd_pool, cmd_len, _init_command_complete);
+
+  buf = tx_slot_acquire(&_cmd_pool);
+  cmd_len = make_cmd_write_scan_enable(buf, 3);
+  tx_slot_commit(&_cmd_pool, cmd_len, _init_command_complete);
+  log_d("queued init commands.");
+}
+
+static void _inquiry_status(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // 0x00=pending
+    log_d("inquiry pending!");
+    _singleton->_callback(WIIMOTE_EVENT_SCAN_START, 0, NULL, 0);
+  }else{
+    log_d("inquiry failed. error=%02X", status);
+  }
+}
+
+static void _inquiry_cancel_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // OK
+    log_d("inquiry_cancel OK.");
+  }else{
+    log_d("inquiry_cancel failed.");
+  }
+}
+
+static void _name_request_next(void);
+static void _remote_name_request_status(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // 0x00=pending
+    log_d("remote_name_request pending!");
+  }else{
+    log_d("remote_name_request failed. error=%02X", status);
+    for(int i=0; i<scanned_device_list_size; i++){
+      if(scanned_device_list[i].state == SCANNED_DEVICE_NAME_REQUESTED){
+        scanned_device_list[i].state = SCANNED_DEVICE_DONE;
+      }
+    }
+    _name_request_next();
+  }
+}
+
+static void _create_connection_status(uint8_t status, uint8_t* data, uint8_t len){
+  if(status==0x00){ // 0x00=pending
+    log_d("create_connection pending!");
+  }else{
+    log_d("create_connection failed. error=%02X", status);
+  }
+}
+
+static void _reset(void){
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t len = make_cmd_reset(buf);
+  tx_slot_commit(&_cmd_pool, len, _reset_complete);
+  log_d("queued reset.");
+}
+
+static void _write_inquiry_mode_complete(uint8_t status, uint8_t* data, uint8_t len){
+  if(status!=0x00){
+    log_d("write_inquiry_mode failed. error=%02X", status);
+    inquiry_mode_written = -1; // results keep arriving as plain Inquiry Result
+  }
+}
+
+static void _scan_start(){
+  scanned_device_clear();
+  uint8_t *buf;
+  uint16_t len;
+  if(inquiry_mode_written != inquiry_mode){
+    buf = tx_slot_acquire(&_cmd_pool);
+    len = make_cmd_write_inquiry_mode(buf, inquiry_mode);
+    if(tx_slot_commit(&_cmd_pool, len, _write_inquiry_mode_complete) == ESP_OK){
+      inquiry_mode_written = inquiry_mode;
+    }
+  }
+  buf = tx_slot_acquire(&_cmd_pool);
+  len = make_cmd_inquiry(buf, 0x9E8B33, inquiry_length, inquiry_max_responses);
+  tx_slot_commit(&_cmd_pool, len, _inquiry_status);
+  log_d("queued inquiry.");
+}
+
+static void _scan_stop(){
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t len = make_cmd_inquiry_cancel(buf);
+  tx_slot_commit(&_cmd_pool, len, _inquiry_cancel_complete);
+  log_d("queued inquiry_cancel.");
+}
+
+static void process_command_complete_event(uint8_t len, uint8_t* data){
+  hci_command_credits = data[0]; // Num_HCI_Command_Packets
+  uint16_t opcode = (data[2] << 8) | data[1];
+  if(opcode == 0x0000){ // NOP: credits only
+    return;
+  }
+  struct hci_command_t hci_command;
+  if(!hci_command_remove(opcode, &hci_command)){
+    log_d("### process_command_complete_event no impl ### opcode=%04X", opcode);
+    return;
+  }
+  if(hci_command.complete){
+    // data[3..] Return_Parameters, starting with Status
+    hci_command.complete(data[3], data+3, len-3);
+  }
+}
+
+static void process_command_status_event(uint8_t len, uint8_t* data){
+  hci_command_credits = data[1]; // Num_HCI_Command_Packets
+  uint16_t opcode = (data[3] << 8) | data[2];
+  if(opcode == 0x0000){ // NOP: credits only
+    return;
+  }
+  struct hci_command_t hci_command;
+  if(!hci_command_remove(opcode, &hci_command)){
+    log_d("### process_command_status_event no impl ### opcode=%04X", opcode);
+    return;
+  }
+  if(hci_command.complete){
+    hci_command.complete(data[0], NULL, 0);
+  }
+}
+
+static void _create_connection(const scanned_device_t *scanned_device){
+  struct requested_connection_t requested_connection;
+  requested_connection.bd_addr = scanned_device->bd_addr;
+  requested_connection_add(requested_connection);
+
+  uint16_t pt = 0x0008;
+  uint8_t ars = 0x00;
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t len = make_cmd_create_connection(buf, scanned_device->bd_addr, pt, scanned_device->psrm, scanned_device->clkofs, ars);
+  if(tx_slot_commit(&_cmd_pool, len, _create_connection_status) != ESP_OK){
+    requested_connection_remove(&requested_connection.bd_addr);
+    return;
+  }
+  log_d("queued create_connection.");
+}
+
+static bool remote_name_is_wiimote(const char *name, size_t len){
+  static const char *names[] = { "Nintendo RVL-CNT-01", "Nintendo RVL-WBC-01" }; // remote, balance board
+  for(const char *wiimote : names){
+    if(strlen(wiimote) == len && memcmp(wiimote, name, len) == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+// One remote name request at a time, to the strongest pending candidate: results arriving meanwhile
+// queue up, so in a crowded room the closest remote is asked (and connected) first. The first candidate
+// is asked without waiting for others, see set_inquiry().
+static void _name_request_next(void){
+  int best = -1;
+  for(int i=0; i<scanned_device_list_size; i++){
+    scanned_device_t *d = &scanned_device_list[i];
+    if(d->state == SCANNED_DEVICE_NAME_REQUESTED){
+      return;
+    }
+    if(d->state == SCANNED_DEVICE_PENDING && (best < 0 || scanned_device_list[best].rssi < d->rssi)){
+      best = i;
+    }
+  }
+  if(best < 0){
+    return;
+  }
+  scanned_device_t *d = &scanned_device_list[best];
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t len = make_cmd_remote_name_request(buf, d->bd_addr, d->psrm, d->clkofs);
+  if(tx_slot_commit(&_cmd_pool, len, _remote_name_request_status) == ESP_OK){
+    d->state = SCANNED_DEVICE_NAME_REQUESTED;
+    log_d("queued remote_name_request. rssi=%d", d->rssi);
+  }
+}
+
+// Local name from Extended Inquiry Response data (0x08 shortened, 0x09 complete), NULL if absent.
+static const char* eir_name(const uint8_t *eir, size_t eir_len, size_t *name_len){
+  for(size_t pos = 0; pos + 1 < eir_len && eir[pos] != 0; pos += 1 + eir[pos]){
+    uint8_t field_len = eir[pos];
+    if(eir_len < pos + 1 + field_len){
+      break;
+    }
+    if(eir[pos+1] == 0x08 || eir[pos+1] == 0x09){
+      *name_len = field_len - 1;
+      return (const char*)(eir + pos + 2);
+    }
+  }
+  return NULL;
+}
+
+// A response from any of the inquiry result events. Only remotes take a slot in scanned_device_list.
+static void process_inquiry_response(struct bd_addr_t bd_addr, uint8_t psrm, const uint8_t *cod, const uint8_t *clock_offset, int8_t rssi, const uint8_t *eir, size_t eir_len){
+  log_d("**** inquiry_result BD_ADDR = %s RSSI = %d", formatHex((uint8_t*)&bd_addr.addr, BD_ADDR_LEN), rssi);
+  log_d("    Page_Scan_Repetition_Mode = %02X", psrm);
+  log_d("    Class_of_Device = %02X %02X %02X", cod[0], cod[1], cod[2]);
+  log_d("    Clock_Offset = %02X %02X", clock_offset[0], clock_offset[1]);
+  if(!(cod[0]==0x04 && cod[1]==0x25 && cod[2]==0x00)){ // Filter for Wiimote [04 25 00]
+    log_d("skiped to remote_name_request. (not Wiimote COD)");
+    return;
+  }
+  int idx = scanned_device_find(&bd_addr);
+  if(0<=idx){
+    log_d(" (dup idx=%d)", idx);
+    scanned_device_list[idx].rssi = rssi;
+    return;
+  }
+
+  struct scanned_device_t scanned_device;
+  scanned_device.bd_addr = bd_addr;
+  scanned_device.psrm    = psrm;
+  scanned_device.clkofs  = ((0x80 | clock_offset[0]) << 8) | (clock_offset[1]);
+  scanned_device.rssi    = rssi;
+  scanned_device.state   = SCANNED_DEVICE_PENDING;
+
+  size_t name_len = 0;
+  const char *name = eir ? eir_name(eir, eir_len, &name_len) : NULL;
+  bool known = 0<=known_device_find(&bd_addr);
+  if(known || (name && remote_name_is_wiimote(name, name_len))){
+    scanned_device.state = SCANNED_DEVICE_DONE;
+  }
+  if(scanned_device_add(scanned_device) < 0){
+    log_d("failed to scanned_device_add.");
+    return;
+  }
+  if(scanned_device.state == SCANNED_DEVICE_DONE){
+    known_device_add(&scanned_device); // this inquiry's psrm/clkofs are the freshest
+    stat_add(stats.name_requests_skipped);
+    _create_connection(&scanned_device);
+    log_d("%s, skipped remote_name_request.", known ? "known device" : "name in EIR");
+    return;
+  }
+  _name_request_next();
+}
+
+// BD_ADDR(6) Page_Scan_Repetition_Mode(1) Reserved(2) Class_of_Device(3) Clock_Offset(2)
+static void process_inquiry_result_event(uint8_t len, uint8_t* data){
+  uint8_t num = data[0];
+  for(int i=0; i<num && 1 + 14 * (i+1) <= len; i++){
+    uint8_t *r = data + 1 + 14 * i;
+    struct bd_addr_t bd_addr;
+    STREAM_TO_BDADDR(bd_addr.addr, r);
+    process_inquiry_response(bd_addr, r[6], r+9, r+12, 0, NULL, 0);
+  }
+}
+
+// BD_ADDR(6) Page_Scan_Repetition_Mode(1) Reserved(1) Class_of_Device(3) Clock_Offset(2) RSSI(1)
+static void process_inquiry_result_with_rssi_event(uint8_t len, uint8_t* data){
+  uint8_t num = data[0];
+  for(int i=0; i<num && 1 + 14 * (i+1) <= len; i++){
+    uint8_t *r = data + 1 + 14 * i;
+    struct bd_addr_t bd_addr;
+    STREAM_TO_BDADDR(bd_addr.addr, r);
+    process_inquiry_response(bd_addr, r[6], r+8, r+11, (int8_t)r[13], NULL, 0);
+  }
+}
+
+// As with RSSI, for a single response, followed by 240 bytes of Extended Inquiry Response data
+static void process_extended_inquiry_result_event(uint8_t len, uint8_t* data){
+  if(len < 1 + 14){
+    return;
+  }
+  uint8_t *r = data + 1;
+  struct bd_addr_t bd_addr;
+  STREAM_TO_BDADDR(bd_addr.addr, r);
+  process_inquiry_response(bd_addr, r[6], r+8, r+11, (int8_t)r[13], r+14, len - 1 - 14);
+}
+
+static void process_inquiry_complete_event(uint8_t len, uint8_t* data){
+  uint8_t status = data[0];
+  log_d("inquiry_complete status=%02X", status);
+  _singleton->_callback(WIIMOTE_EVENT_SCAN_STOP, 0, NULL, 0);
+}
+
+static void process_remote_name_request_complete_event(uint8_t len, uint8_t* data){
+  uint8_t status = data[0];
+  log_d("remote_name_request_complete status=%02X", status);
+  struct bd_addr_t bd_addr;
+  STREAM_TO_BDADDR(bd_addr.addr, data+1);
+  log_d("  BD_ADDR = %s", formatHex((uint8_t*)&bd_addr.addr, BD_ADDR_LEN));
+
+  char* name = (char*)(data+7);
+  log_d("  REMOTE_NAME = %s", name);
+
+  int idx = scanned_device_find(&bd_addr);
+  if(0<=idx){
+    scanned_device_list[idx].state = SCANNED_DEVICE_DONE;
+    if(status == 0x00 && remote_name_is_wiimote(name, strnlen(name, 248))){
+      known_device_add(&scanned_device_list[idx]);
+      _create_connection(&scanned_device_list[idx]);
+    }
+  }
+  _name_request_next();
+}
+
+static void _l2cap_connect(uint16_t connection_handle, uint16_t psm, uint16_t source_cid){
+  uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
   uint16_t channel_id           = 0x0001;
-  uint8_t data[] = {
-    0x02,                               // CONNECTION REQUEST
-    _g_identifier++,                    // Identifier
-    0x04, 0x00,                         // Length:     0x0004
-    (uint8_t)(psm & 0xFF), (uint8_t)(psm >> 8), // PSM: HID_Control=0x0011, HID_Interrupt=0x0013
-    (uint8_t)(source_cid & 0xFF), (uint8_t)(source_cid >> 8)  // Source CID: 0x0040+
-  };
-  uint16_t data_len = 8;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0x02);            // CONNECTION REQUEST
+  UINT8_TO_STREAM (data, _g_identifier++); // Identifier
+  UINT16_TO_STREAM(data, 0x0004);          // Length:     0x0004
+  UINT16_TO_STREAM(data, psm);             // PSM: HID_Control=0x0011, HID_Interrupt=0x0013
+  UINT16_TO_STREAM(data, source_cid);      // Source CID: 0x0040+
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
   log_d("queued acl_l2cap_single_packet(CONNECTION REQUEST)");
 
   struct l2cap_connection_t l2cap_connection;
-  l2cap_connection.connection_handle = connection_handle;
   l2cap_connection.psm               = psm;
   l2cap_connection.local_cid         = source_cid;
   l2cap_connection.remote_cid        = 0;
   l2cap_connection.initiator         = true;
-  int idx = l2cap_connection_add(l2cap_connection);
-  if(idx == -1){
+  if(!l2cap_connection_add(connection_handle, l2cap_connection)){
     log_d("!!! l2cap_connection_add failed.");
   }
 }
 
 static void _l2cap_configure(uint16_t connection_handle, uint16_t local_cid, uint16_t mtu){
-  int idx = l2cap_connection_find_by_local_cid(connection_handle, local_cid);
-  struct l2cap_connection_t *l2cap_connection = &l2cap_connection_list[idx];
-
-  uint8_t packet_boundary_flag = 0b10; // Packet_Boundary_Flag
-  uint8_t broadcast_flag = 0b00;       // Broadcast_Flag
-  uint16_t channel_id = 0x0001;
-  uint8_t data[] = {
-      0x04,                                         // CONFIGURATION REQUEST
-      _g_identifier++,                              // Identifier
-      0x08, 0x00,                                   // Length: 0x0008
-      (uint8_t)(l2cap_connection->remote_cid & 0xFF), (uint8_t)(l2cap_connection->remote_cid >> 8), // Destination CID
-      0x00, 0x00,                                   // Flags
-      0x01, 0x02,
-      (uint8_t)(mtu & 0xFF), (uint8_t)(mtu >> 8) // type=01 len=02 value=2 bytes mtu
-    };
-
-    uint16_t data_len = 12;
-    uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-    _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-    log_d("queued acl_l2cap_single_packet(l2cap configure)");
-}
-
-static void _l2cap_close(uint16_t connection_handle, uint16_t psm){
-  int idx = l2cap_connection_find_by_psm(connection_handle, psm);
-  if (idx < 0) {
-    log_e("Failed to find connection for handle %02X, and psm %02X", connection_handle, psm);
+  struct l2cap_connection_t *l2cap_connection = l2cap_connection_find_by_local_cid(connection_handle, local_cid);
+  if(!l2cap_connection){
+    log_e("Failed to find connection for handle %02X, and local_cid %04X", connection_handle, local_cid);
     return;
   }
 
-  struct l2cap_connection_t *l2cap_connection = &l2cap_connection_list[idx];
-
   uint8_t packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t broadcast_flag = 0b00;       // Broadcast_Flag
   uint16_t channel_id = 0x0001;
-  uint8_t data[] = {
-      0x06,                                         // CLOSE REQUEST
-      _g_identifier++,                              // Identifier
-      0x04, 0x00,                                   // Length: 0x0004
-      (uint8_t)(l2cap_connection->remote_cid & 0xFF), (uint8_t)(l2cap_connection->remote_cid >> 8), // Destination CID
-      (uint8_t)(l2cap_connection->local_cid & 0xFF), (uint8_t)(l2cap_connection->local_cid >> 8), // Source CID
-    };
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0x04);                         // CONFIGURATION REQUEST
+  UINT8_TO_STREAM (data, _g_identifier++);              // Identifier
+  UINT16_TO_STREAM(data, 0x0008);                       // Length: 0x0008
+  UINT16_TO_STREAM(data, l2cap_connection->remote_cid); // Destination CID
+  UINT16_TO_STREAM(data, 0x0000);                       // Flags
+  UINT8_TO_STREAM (data, 0x01);
+  UINT8_TO_STREAM (data, 0x02);
+  UINT16_TO_STREAM(data, mtu);                          // type=01 len=02 value=2 bytes mtu
+
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
+  log_d("queued acl_l2cap_single_packet(l2cap configure)");
+}
 
-    uint16_t data_len = 8;
-    uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-    _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-    log_d("queued acl_l2cap_single_packet(l2cap close)");
+// connection with an open HID interrupt channel to send output reports on
+static connection_t* _output_connection(uint16_t connection_handle){
+  connection_t *c = connection_find(connection_handle);
+  if(!c || c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid == 0){
+    log_e("No HID interrupt channel for handle %02X", connection_handle);
+    return NULL;
+  }
+  return c;
 }
 
+// Every output report carries the rumble bit in the LSB of its first byte.
 static void _set_rumble(uint16_t connection_handle, bool rumble){
-  int idx = l2cap_connection_find_by_psm(connection_handle, PSM_HID_Interrupt_13);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+  connection_t *c = _output_connection(connection_handle);
+  if(!c){
+    return;
+  }
 
   uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-  uint16_t channel_id           = l2cap_connection.remote_cid;
-  uint8_t data[] = {
-    0xA2,
-    0x10,
-    (uint8_t)(rumble ? 0x01 : 0x00) // 0x0? - 0xF?
-  };
-  uint16_t data_len = 3;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0xA2);
+  UINT8_TO_STREAM (data, 0x10);
+  UINT8_TO_STREAM (data, (uint8_t)(rumble ? 0x01 : 0x00)); // 0x0? - 0xF?
+  c->rumble = rumble;
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
   log_d("queued acl_l2cap_single_packet(Set Rumble)");
 }
 
 static void _set_led(uint16_t connection_handle, uint8_t leds){
-  int idx = l2cap_connection_find_by_psm(connection_handle, PSM_HID_Interrupt_13);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+  connection_t *c = _output_connection(connection_handle);
+  if(!c){
+    return;
+  }
 
   uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-  uint16_t channel_id           = l2cap_connection.remote_cid;
-  uint8_t data[] = {
-    0xA2,
-    0x11,
-    (uint8_t)(leds << 4) // 0x0? - 0xF?
-  };
-  uint16_t data_len = 3;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0xA2);
+  UINT8_TO_STREAM (data, 0x11);
+  UINT8_TO_STREAM (data, (uint8_t)(leds << 4) | c->rumble); // 0x0? - 0xF?
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
   log_d("queued acl_l2cap_single_packet(Set LEDs)");
 }
 
 static void _set_reporting_mode(uint16_t connection_handle, uint8_t reporting_mode, bool continuous){
-  int idx = l2cap_connection_find_by_psm(connection_handle, PSM_HID_Interrupt_13);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+  connection_t *c = _output_connection(connection_handle);
+  if(!c){
+    return;
+  }
 
   uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-  uint16_t channel_id           = l2cap_connection.remote_cid;
-  uint8_t data[] = {
-    0xA2,
-    0x12,
-    (uint8_t)(continuous ? 0x04 : 0x00), // 0x00, 0x04
-    reporting_mode
-  };
-  uint16_t data_len = 4;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0xA2);
+  UINT8_TO_STREAM (data, 0x12);
+  UINT8_TO_STREAM (data, (continuous ? 0x04 : 0x00) | c->rumble); // 0x00, 0x04
+  UINT8_TO_STREAM (data, reporting_mode);
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
   log_d("queued acl_l2cap_single_packet(Set reporting mode)");
 }
 
 static void _initiate_auth(uint16_t handle) {
-  uint16_t data_len = make_cmd_auth_request(tmp_data, handle);
-  _queue_data(_tx_queue, tmp_data, data_len);
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t data_len = make_cmd_auth_request(buf, handle);
+  tx_slot_commit(&_cmd_pool, data_len);
   log_d("queued auth request(initiate auth)");
 }
 
-enum address_space_t {
-  EEPROM_MEMORY,
-  CONTROL_REGISTER
-};
 
-static uint8_t _address_space(address_space_t as){
+static uint8_t _address_space(wiimote_address_space_t as){
   switch(as){
-    case EEPROM_MEMORY   : return 0x00;
-    case CONTROL_REGISTER: return 0x04;
+    case WIIMOTE_EEPROM_MEMORY   : return 0x00;
+    case WIIMOTE_CONTROL_REGISTER: return 0x04;
   }
   return 0xFF;
 }
 
-static void _write_memory(uint16_t connection_handle, address_space_t as, uint32_t offset, uint8_t size, const uint8_t* d){
-  int idx = l2cap_connection_find_by_psm(connection_handle, PSM_HID_Interrupt_13);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+// Sends size bytes as 16-byte 0x16 reports; callback runs once the last one is acknowledged.
+static bool _write_memory(uint16_t connection_handle, wiimote_address_space_t as, uint32_t offset, uint16_t size, const uint8_t* d, wiimote_memory_callback_t callback = NULL, void *ctx = NULL){
+  connection_t *c = _output_connection(connection_handle);
+  if(!c || size == 0){
+    return false;
+  }
+  memory_request_t *request = memory_request_add(c);
+  if(!request){
+    log_e("memory request list full, write dropped");
+    return false;
+  }
+  request->write    = true;
+  request->offset   = offset;
+  request->size     = size;
+  request->callback = callback;
+  request->ctx      = ctx;
 
   uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-  uint16_t channel_id           = l2cap_connection.remote_cid;
-  // (a2) 16 MM FF FF FF SS DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD
-  uint8_t data[] = {
-    0xA2,
-    0x16, // Write
-    _address_space(as),    // MM 0x00=EEPROM, 0x04=ControlRegister
-    (uint8_t)((offset >> 16) & 0xFF), // FF
-    (uint8_t)((offset >>  8) & 0xFF), // FF
-    (uint8_t)((offset      ) & 0xFF), // FF
-    size,                  // SS size 1..16
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-  };
-  memcpy(data+7, d, size);
-
-  uint16_t data_len = 7 + 16;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-  log_d("queued acl_l2cap_single_packet(write memory)");
-}
-
-static void _read_memory(uint16_t connection_handle, address_space_t as, uint32_t offset, uint16_t size){
-  int idx = l2cap_connection_find_by_psm(connection_handle, PSM_HID_Interrupt_13);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
+  for(uint16_t done = 0; done < size; done += 16){
+    uint8_t chunk_size = size - done < 16 ? size - done : 16;
+    uint32_t chunk_offset = offset + done;
+    // (a2) 16 MM FF FF FF SS DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD
+    uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+    uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+    UINT8_TO_STREAM (data, 0xA2);
+    UINT8_TO_STREAM (data, 0x16);                            // Write
+    UINT8_TO_STREAM (data, _address_space(as) | c->rumble);  // MM 0x00=EEPROM, 0x04=ControlRegister
+    UINT8_TO_STREAM (data, (chunk_offset >> 16) & 0xFF);     // FF
+    UINT8_TO_STREAM (data, (chunk_offset >>  8) & 0xFF);     // FF
+    UINT8_TO_STREAM (data, (chunk_offset      ) & 0xFF);     // FF
+    UINT8_TO_STREAM (data, chunk_size);                      // SS size 1..16
+    memcpy(data, d + done, chunk_size);
+    memset(data + chunk_size, 0, 16 - chunk_size);
+    data += 16;
+
+    uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+    uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+    if(tx_slot_commit(&_acl_pool, len) != ESP_OK){
+      break;
+    }
+    request->chunks++;
+  }
+  if(request->chunks == 0){ // nothing sent, it is still the last entry
+    c->memory_request_list_size--;
+    return false;
+  }
+  if(request->chunks * 16 < size){
+    request->error = WIIMOTE_MEMORY_DROPPED; // completes with the acks of the chunks that were sent
+  }
+  log_d("queued acl_l2cap_single_packet(write memory) x%d", request->chunks);
+  return true;
+}
+
+// The remote answers with 0x21 reports of up to 16 bytes each, reassembled into buffer.
+static bool _read_memory(uint16_t connection_handle, wiimote_address_space_t as, uint32_t offset, uint16_t size, uint8_t *buffer, wiimote_memory_callback_t callback = NULL, void *ctx = NULL){
+  connection_t *c = _output_connection(connection_handle);
+  if(!c || size == 0){
+    return false;
+  }
+  memory_request_t *request = memory_request_add(c);
+  if(!request){
+    log_e("memory request list full, read dropped");
+    return false;
+  }
+  request->offset   = offset;
+  request->size     = size;
+  request->buffer   = buffer;
+  request->callback = callback;
+  request->ctx      = ctx;
 
   uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-  uint16_t channel_id           = l2cap_connection.remote_cid;
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
   // (a2) 17 MM FF FF FF SS SS
-  uint8_t data[] = {
-    0xA2,
-    0x17, // Read
-    _address_space(as),    // MM 0x00=EEPROM, 0x04=ControlRegister
-    (uint8_t)((offset >> 16) & 0xFF), // FF
-    (uint8_t)((offset >>  8) & 0xFF), // FF
-    (uint8_t)((offset      ) & 0xFF), // FF
-    (uint8_t)((size >> 8   ) & 0xFF), // SS
-    (uint8_t)((size        ) & 0xFF)  // SS
-  };
-  uint16_t data_len = 8;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+  uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (data, 0xA2);
+  UINT8_TO_STREAM (data, 0x17);                  // Read
+  UINT8_TO_STREAM (data, _address_space(as) | c->rumble); // MM 0x00=EEPROM, 0x04=ControlRegister
+  UINT8_TO_STREAM (data, (offset >> 16) & 0xFF); // FF
+  UINT8_TO_STREAM (data, (offset >>  8) & 0xFF); // FF
+  UINT8_TO_STREAM (data, (offset      ) & 0xFF); // FF
+  UINT8_TO_STREAM (data, (size >> 8   ) & 0xFF); // SS
+  UINT8_TO_STREAM (data, (size        ) & 0xFF); // SS
+  uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  if(tx_slot_commit(&_acl_pool, len) != ESP_OK){
+    c->memory_request_list_size--;
+    return false;
+  }
   log_d("queued acl_l2cap_single_packet(read memory)");
+  return true;
+}
+
+// Picks the reporting mode carrying what the remote has and the application asked for.
+static void _select_reporting_mode(connection_t *c){
+  uint8_t mode;
+  switch(c->ir_mode){
+    case WIIMOTE_IR_FULL    : mode = 0x3E;                           break; // 0x3E/0x3F: BB BB AA II*18
+    case WIIMOTE_IR_EXTENDED: mode = 0x33;                           break; // 0x33: BB BB AA AA AA II*12
+    case WIIMOTE_IR_BASIC   : mode = c->accel_enabled ? 0x37 : 0x36; break; // 0x37: BB BB AA AA AA II*10 EE*6, 0x36: BB BB II*10 EE*9
+    default:
+      switch(c->extension){
+        case EXTENSION_NUNCHUK      : mode = c->accel_enabled ? 0x35 : 0x32; break; // 0x35: BB BB AA AA AA EE*16, 0x32: BB BB EE*8
+        case EXTENSION_BALANCE_BOARD: mode = 0x34;                           break; // 0x34: BB BB EE*19
+        default                     : mode = c->accel_enabled ? 0x31 : 0x30; break; // 0x31: BB BB AA AA AA, 0x30: BB BB
+      }
+  }
+  // the accelerometer and camera change on every sample, so ask for reports at the full rate
+  _set_reporting_mode(c->connection_handle, mode, c->accel_enabled || c->ir_mode != WIIMOTE_IR_OFF);
+}
+
+// 0x13 IR camera pixel clock, 0x1A IR camera logic
+static void _set_ir_camera(uint16_t connection_handle, bool enable){
+  connection_t *c = _output_connection(connection_handle);
+  if(!c){
+    return;
+  }
+
+  uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
+  uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
+  uint16_t channel_id           = c->l2cap[L2CAP_CHANNEL_INTERRUPT].remote_cid;
+  static const uint8_t report_ids[] = { 0x13, 0x1A };
+  for(uint8_t report_id : report_ids){
+    uint8_t *buf  = tx_slot_acquire(&_acl_pool);
+    uint8_t *data = ACL_L2CAP_PAYLOAD(buf);
+    UINT8_TO_STREAM (data, 0xA2);
+    UINT8_TO_STREAM (data, report_id);
+    UINT8_TO_STREAM (data, (enable ? 0x04 : 0x00) | c->rumble);
+    uint16_t data_len = data - ACL_L2CAP_PAYLOAD(buf);
+    uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+    tx_slot_commit(&_acl_pool, len);
+  }
+  log_d("queued acl_l2cap_single_packet(IR camera)");
+}
+
+static void _ir_enable(connection_t *c, wiimote_ir_mode_t mode, uint8_t sensitivity){
+  uint16_t connection_handle = c->connection_handle;
+  c->ir_mode = mode;
+  for(int i=0; i<4; i++){
+    c->ir_blobs[i] = { 1023, 1023, 0, 0 }; // as the camera reports a blob it doesn't track
+  }
+  if(mode == WIIMOTE_IR_OFF){
+    _set_ir_camera(connection_handle, false);
+    return;
+  }
+  const uint8_t *block = ir_sensitivity_blocks[(sensitivity < 1 ? 1 : 5 < sensitivity ? 5 : sensitivity) - 1];
+  _set_ir_camera(connection_handle, true);
+  _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xB00030, 1, (const uint8_t[]){0x08});
+  _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xB00000, 9, block);          // sensitivity block 1
+  _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xB0001A, 2, block + 9);      // sensitivity block 2
+  uint8_t mode_number = mode;
+  _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xB00033, 1, &mode_number);
+  _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xB00030, 1, (const uint8_t[]){0x08});
+}
+
+static void accel_calibration_complete(uint16_t connection_handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx){
+  connection_t *c = connection_find(connection_handle);
+  if(c && error == WIIMOTE_MEMORY_OK && accel_calibration_init(c, data)){
+    device_cache_t cache = c->cache;
+    cache.accel_calibrated = true;
+    memcpy(cache.accel_calibration_data, data, sizeof(cache.accel_calibration_data));
+    device_cache_update(c, &cache);
+  }
+}
+
+static void _connected(uint16_t connection_handle){
+  connection_t *c = connection_find(connection_handle);
+  if(c){
+    _read_memory(connection_handle, WIIMOTE_EEPROM_MEMORY, ACCEL_CALIBRATION_ADDRESS, ACCEL_CALIBRATION_SIZE, c->accel_calibration_data, accel_calibration_complete);
+  }
+  _singleton->_callback(WIIMOTE_EVENT_CONNECT, connection_handle, NULL, 0);
 }
 
 static void process_connection_request_event(uint8_t len, uint8_t* data){
@@ -660,8 +2219,9 @@ static void process_connection_request_event(uint8_t len, uint8_t* data){
   log_d("   Connection request:");
   log_d("   Class_of_Device = %02X %02X %02X", data[6], data[7], data[8]);
   log_d("   Link type %02X", link_type);
-  uint16_t data_len = make_cmd_accept_connection(tmp_data, bd_addr);
-  _queue_data(_tx_queue, tmp_data, data_len);
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t data_len = make_cmd_accept_connection(buf, bd_addr);
+  tx_slot_commit(&_cmd_pool, data_len);
   log_d("queued accept_connection(process_connection_request_event)");
 }
 
@@ -680,6 +2240,23 @@ static void process_connection_complete_event(uint8_t len, uint8_t* data){
   log_d("  Link_Type          = %02X", lt);
   log_d("  Encryption_Enabled = %02X", ee);
 
+  if(status != 0x00){
+    known_device_remove(&bd_addr); // identify it by name again on the next inquiry
+    requested_connection_remove(&bd_addr);
+    return;
+  }
+  connection_t *c = connection_add(connection_handle);
+  if(!c){
+    log_d("!!! connection_add failed.");
+    return;
+  }
+  c->bd_addr = bd_addr;
+  device_cache_restore(c);
+  stat_add(stats.connections);
+  if(seen_device_check(&bd_addr)){
+    stat_add(stats.reconnects);
+  }
+
   // Check to see if we requested this connection
   if (requested_connection_find(&bd_addr) >= 0) {
     _l2cap_connect(connection_handle, PSM_HID_Control_11, _g_local_cid++);
@@ -699,15 +2276,48 @@ static void process_disconnection_complete_event(uint8_t len, uint8_t* data){
   log_d("  Connection_Handle  = 0x%04X", ch);
   log_d("  Reason             = %02X", reason);
 
+  connection_t *c = connection_find(ch);
+  if(c){
+    acl_credit_release_link(c);
+    connection_remove(ch);
+    stat_add(stats.disconnects);
+  }
   _singleton->_callback(WIIMOTE_EVENT_DISCONNECT, ch, NULL, 0);
 }
 
 static void process_link_key_request_event(uint8_t len, uint8_t* data) {
   struct bd_addr_t bd_addr;
   STREAM_TO_BDADDR(bd_addr.addr, data);
-  uint16_t data_len = make_cmd_negative_reply(tmp_data, bd_addr);
-  _queue_data(_tx_queue, tmp_data, data_len);
-  log_d("queued negative link key reply(process_link_key_request)");
+  const link_key_t *link_key = link_key_find(&bd_addr);
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  if(link_key){
+    uint16_t data_len = make_cmd_link_key_reply(buf, bd_addr, link_key->key);
+    tx_slot_commit(&_cmd_pool, data_len);
+    log_d("queued link key reply(process_link_key_request)");
+  }else{
+    uint16_t data_len = make_cmd_negative_reply(buf, bd_addr);
+    tx_slot_commit(&_cmd_pool, data_len);
+    log_d("queued negative link key reply(process_link_key_request)");
+  }
+}
+
+static void process_link_key_notification_event(uint8_t len, uint8_t* data) {
+  struct bd_addr_t bd_addr;
+  STREAM_TO_BDADDR(bd_addr.addr, data);
+  uint8_t key_type = data[6 + LINK_KEY_LEN];
+  log_d("link key notification BD_ADDR = %s type=%02X", formatHex((uint8_t*)&bd_addr.addr, BD_ADDR_LEN), key_type);
+  link_key_add(&bd_addr, data + 6, key_type);
+}
+
+static void process_authentication_complete_event(uint8_t len, uint8_t* data) {
+  uint8_t status = data[0];
+  uint16_t connection_handle = data[2] << 8 | data[1];
+  log_d("authentication_complete status=%02X handle=%04X", status, connection_handle);
+  connection_t *c = connection_find(connection_handle);
+  // 0x05 Authentication Failure, 0x06 PIN or Key Missing: the remote no longer has our key
+  if(c && (status == 0x05 || status == 0x06) && link_key_remove(&c->bd_addr)){
+    link_key_list_dirty = true; // the next attempt falls back to the PIN
+  }
 }
 
 static void process_pin_request_event(uint8_t len, uint8_t *data) {
@@ -724,17 +2334,17 @@ static void process_pin_request_event(uint8_t len, uint8_t *data) {
     pin_data[i] = tmp;
   }
   log_d("Pin data=%s", formatHex(pin_data, 6));
-  uint16_t data_len = make_cmd_pin_reply(tmp_data, bd_addr, pin_data);
-  _queue_data(_tx_queue, tmp_data, data_len);
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t data_len = make_cmd_pin_reply(buf, bd_addr, pin_data);
+  tx_slot_commit(&_cmd_pool, data_len);
   log_d("queued pin reply(process_pin_request)");
 }
 
-static void process_l2cap_connection_request(uint16_t connection_handle, uint8_t *data)
+static void process_l2cap_connection_request(uint16_t connection_handle, uint16_t l2cap_cid, uint8_t* data, uint16_t l2cap_len)
 {
   uint16_t source_cid = (data[7] << 8) | data[6];
   uint16_t psm = (data[5] << 8) | data[4];
   struct l2cap_connection_t l2cap_connection;
-  l2cap_connection.connection_handle = connection_handle;
   l2cap_connection.psm = psm;
   l2cap_connection.remote_cid = source_cid;
   l2cap_connection.local_cid = _g_local_cid++;
@@ -746,34 +2356,38 @@ static void process_l2cap_connection_request(uint16_t connection_handle, uint8_t
   log_d("  remote_cid      = %04X", source_cid);
   log_d("  psm          = %04X", psm);
 
-  int idx = l2cap_connection_add(l2cap_connection);
-  if (idx == -1)
+  uint16_t result = 0x0000;
+  if (l2cap_channel_of_psm(psm) < 0)
+  {
+    log_d("!!! psm not supported.");
+    result = 0x0002; // Connection refused - PSM not supported
+  }
+  else if (!l2cap_connection_add(connection_handle, l2cap_connection))
   {
     log_d("!!! failed to add l2cap_connection.");
+    result = 0x0004; // Connection refused - no resources available
   }
-
-  uint16_t result = idx != -1? 0x00 : 0x04; // Connection refused if idx == -1.
-  uint8_t response_data[] = {
-      0x03,
-      data[1], // Request identifier
-      0x08, 0x00,
-      (uint8_t)(l2cap_connection.local_cid & 0xFF), (uint8_t)(l2cap_connection.local_cid >> 8),
-      (uint8_t)(l2cap_connection.remote_cid & 0xFF), (uint8_t)(l2cap_connection.remote_cid >> 8),
-      (uint8_t)(result & 0xFF), (uint8_t)(result >> 8),
-      0x00, 0x00, // No status
-  };
+  uint8_t *buf = tx_slot_acquire(&_acl_pool);
+  uint8_t *response_data = ACL_L2CAP_PAYLOAD(buf);
+  UINT8_TO_STREAM (response_data, 0x03);
+  UINT8_TO_STREAM (response_data, data[1]); // Request identifier
+  UINT16_TO_STREAM(response_data, 0x0008);
+  UINT16_TO_STREAM(response_data, l2cap_connection.local_cid);
+  UINT16_TO_STREAM(response_data, l2cap_connection.remote_cid);
+  UINT16_TO_STREAM(response_data, result);
+  UINT16_TO_STREAM(response_data, 0x0000);  // No status
 
   uint8_t packet_boundary_flag = 0b10;
   uint8_t broadcast_flag = 0b00;
   uint16_t channel_id = 1;
 
-  uint16_t data_len = 12;
-  uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, response_data, data_len);
-  _queue_data(_tx_queue, tmp_data, len);
+  uint16_t data_len = response_data - ACL_L2CAP_PAYLOAD(buf);
+  uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+  tx_slot_commit(&_acl_pool, len);
   log_d("queued acl_l2cap_single_packet(CONNECTION RESPONSE)");
 }
 
-static void process_l2cap_connection_response(uint16_t connection_handle, uint8_t* data){
+static void process_l2cap_connection_response(uint16_t connection_handle, uint16_t l2cap_cid, uint8_t* data, uint16_t l2cap_len){
   uint8_t identifier       =  data[ 1];
   uint16_t len             = (data[ 3] << 8) | data[ 2];
   uint16_t destination_cid = (data[ 5] << 8) | data[ 4];
@@ -783,20 +2397,24 @@ static void process_l2cap_connection_response(uint16_t connection_handle, uint8_
 
   log_d("L2CAP CONNECTION RESPONSE");
   log_d("  identifier      = %02X", identifier);
+  log_d("  len             = %04X", len);
   log_d("  destination_cid = %04X", destination_cid);
   log_d("  source_cid      = %04X", source_cid);
   log_d("  result          = %04X", result);
   log_d("  status          = %04X", status);
 
   if(result == 0x0000){
-    int idx = l2cap_connection_find_by_local_cid(connection_handle, source_cid);
-    struct l2cap_connection_t *l2cap_connection = &l2cap_connection_list[idx];
+    struct l2cap_connection_t *l2cap_connection = l2cap_connection_find_by_local_cid(connection_handle, source_cid);
+    if(!l2cap_connection){
+      log_d("!!! unknown source_cid");
+      return;
+    }
     l2cap_connection->remote_cid = destination_cid;
-    _l2cap_configure(connection_handle, source_cid, 0x0040);
+    _l2cap_configure(connection_handle, source_cid, L2CAP_MTU);
   }
 }
 
-static void process_l2cap_configuration_response(uint16_t connection_handle, uint8_t* data){
+static void process_l2cap_configuration_response(uint16_t connection_handle, uint16_t l2cap_cid, uint8_t* data, uint16_t l2cap_len){
   uint8_t identifier       =  data[ 1];
   uint16_t len             = (data[ 3] << 8) | data[ 2];
   uint16_t source_cid      = (data[ 5] << 8) | data[ 4];
@@ -812,15 +2430,18 @@ static void process_l2cap_configuration_response(uint16_t connection_handle, uin
   log_d("  result          = %04X", result);
   log_d("  config          = %s", formatHex(data+10, len-6));
 
-  int idx = l2cap_connection_find_by_local_cid(connection_handle, source_cid);
-  struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
+  struct l2cap_connection_t *l2cap_connection = l2cap_connection_find_by_local_cid(connection_handle, source_cid);
+  if(!l2cap_connection){
+    log_d("!!! unknown source_cid");
+    return;
+  }
 
-  if(!l2cap_connection.initiator && l2cap_connection.psm == PSM_HID_Interrupt_13){
-    _singleton->_callback(WIIMOTE_EVENT_CONNECT, connection_handle, NULL, 0);
+  if(!l2cap_connection->initiator && l2cap_connection->psm == PSM_HID_Interrupt_13){
+    _connected(connection_handle);
   }
 }
 
-static void process_l2cap_configuration_request(uint16_t connection_handle, uint8_t* data){
+static void process_l2cap_configuration_request(uint16_t connection_handle, uint16_t l2cap_cid, uint8_t* data, uint16_t l2cap_len){
   uint8_t identifier       =  data[ 1];
   uint16_t len             = (data[ 3] << 8) | data[ 2];
   uint16_t destination_cid = (data[ 5] << 8) | data[ 4];
@@ -834,254 +2455,651 @@ static void process_l2cap_configuration_request(uint16_t connection_handle, uint
   log_d("  flags           = %04X", flags);
   log_d("  config          = %s", formatHex(data+8, len-4));
 
-  if(flags != 0x0000){
-    log_d("!!! flags!=0x0000");
+  if(flags != 0x0000){
+    log_d("!!! flags!=0x0000");
+    return;
+  }
+  if(len != 0x08){
+    log_d("!!! len!=0x08");
+    return;
+  }
+  if(data[8]==0x01 && data[9]==0x02){ // MTU
+    uint16_t mtu = (data[11] << 8) | data[10];
+    log_d("  MTU=%d", mtu);
+
+    struct l2cap_connection_t *l2cap_connection = l2cap_connection_find_by_local_cid(connection_handle, destination_cid);
+    if(!l2cap_connection){
+      log_d("!!! unknown destination_cid");
+      return;
+    }
+
+    uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
+    uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
+    uint16_t channel_id           = 0x0001;
+    uint16_t source_cid           = l2cap_connection->remote_cid;
+    uint8_t *buf = tx_slot_acquire(&_acl_pool);
+    uint8_t *response_data = ACL_L2CAP_PAYLOAD(buf);
+    UINT8_TO_STREAM (response_data, 0x05);       // CONFIGURATION RESPONSE
+    UINT8_TO_STREAM (response_data, identifier); // Identifier
+    UINT16_TO_STREAM(response_data, 0x000A);     // Length: 0x000A
+    UINT16_TO_STREAM(response_data, source_cid); // Source CID
+    UINT16_TO_STREAM(response_data, 0x0000);     // Flags
+    UINT16_TO_STREAM(response_data, 0x0000);     // Res
+    UINT8_TO_STREAM (response_data, 0x01);
+    UINT8_TO_STREAM (response_data, 0x02);
+    UINT16_TO_STREAM(response_data, mtu);        // type=01 len=02 value=xx xx
+    uint16_t data_len = response_data - ACL_L2CAP_PAYLOAD(buf);
+    uint16_t len = make_acl_l2cap_single_packet(buf, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data_len);
+    tx_slot_commit(&_acl_pool, len);
+    log_d("queued acl_l2cap_single_packet(CONFIGURATION RESPONSE)");
+
+    if (l2cap_connection->initiator) {
+      if(l2cap_connection->psm == PSM_HID_Control_11){
+        _singleton->_callback(WIIMOTE_EVENT_NEW, connection_handle, NULL, 0);
+        _l2cap_connect(connection_handle, PSM_HID_Interrupt_13, _g_local_cid++);
+      } else
+      if(l2cap_connection->psm == PSM_HID_Interrupt_13){
+        _connected(connection_handle);
+      }
+    } else {
+      _l2cap_configure(connection_handle, l2cap_connection->local_cid, mtu);
+    }
+  }
+}
+
+static void process_l2cap_connection_close(uint16_t connection_handle, uint16_t l2cap_cid, uint8_t* data, uint16_t l2cap_len){
+    // [D][Wiimote.cpp:796] process_acl_data(): **** ACL_DATA len=16 data=81 20 0C 00 08 00 01 00 06 5C 04 00 32 00 7A 00 
+    // [D][Wiimote.cpp:789] process_l2cap_data():   ### process_l2cap_data no impl ###
+    // [D][Wiimote.cpp:790] process_l2cap_data():   L2CAP len=8 data=06 5C 04 00 32 00 7A 00 
+    // [D][Wiimote.cpp:796] process_acl_data(): **** ACL_DATA len=16 data=81 20 0C 00 08 00 01 00 06 5D 04 00 33 00 7B 00 
+    // [D][Wiimote.cpp:789] process_l2cap_data():   ### process_l2cap_data no impl ###
+    // [D][Wiimote.cpp:790] process_l2cap_data():   L2CAP len=8 data=06 5D 04 00 33 00 7B 00 
+
+  uint16_t source_cid = (data[ 5] << 8) | data[ 4];
+  uint16_t destination_cid = (data[ 7] << 8) | data[ 6];
+  log_d("L2CAP CONNECTION CLOSE");
+  log_d("  handle          = %02X", connection_handle);
+  log_d("  destination_cid = %04X", destination_cid);
+  log_d("  souce_cid       = %04X", source_cid);
+
+  if(!l2cap_connection_remove(connection_handle, source_cid, destination_cid))
+    log_d(" l2cap_connection_remove failed.");
+  else
+    log_d(" l2cap_connection_remove success.");
+}
+
+/**
+ * Report
+ * Byte offsets in the report (0 = not present) by report id, 0x20-0x3F.
+ * https://wiibrew.org/wiki/Wiimote#Data_Reporting
+ */
+struct report_layout_t {
+  uint8_t buttons;
+  uint8_t accel;
+  uint8_t ir;
+  uint8_t ir_len;
+  uint8_t ext;
+  uint8_t ext_len;
+};
+static const report_layout_t report_layouts[0x20] = {
+  { 2, 0,  0,  0,  0,  0 }, // 0x20 Status
+  { 2, 0,  0,  0,  0,  0 }, // 0x21 Read memory data
+  { 2, 0,  0,  0,  0,  0 }, // 0x22 Acknowledge
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 2, 0,  0,  0,  0,  0 }, // 0x30 BB BB
+  { 2, 4,  0,  0,  0,  0 }, // 0x31 BB BB AA AA AA
+  { 2, 0,  0,  0,  4,  8 }, // 0x32 BB BB EE*8
+  { 2, 4,  7, 12,  0,  0 }, // 0x33 BB BB AA AA AA II*12
+  { 2, 0,  0,  0,  4, 19 }, // 0x34 BB BB EE*19
+  { 2, 4,  0,  0,  7, 16 }, // 0x35 BB BB AA AA AA EE*16
+  { 2, 0,  4, 10, 14,  9 }, // 0x36 BB BB II*10 EE*9
+  { 2, 4,  7, 10, 17,  6 }, // 0x37 BB BB AA AA AA II*10 EE*6
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  0,  0 },
+  { 0, 0,  0,  0,  2, 21 }, // 0x3D EE*21
+  { 2, 0,  5, 18,  0,  0 }, // 0x3E BB BB AA II*18 (interleaved, first half)
+  { 2, 0,  5, 18,  0,  0 }, // 0x3F BB BB AA II*18 (interleaved, second half)
+};
+
+static wiimote_report_t current_report;
+static const wiimote_report_t *current_report_ptr = NULL;
+
+bool Wiimote::decode_report(const uint8_t *data, size_t len, wiimote_report_t *report){
+  memset(report, 0, sizeof(wiimote_report_t));
+  if(len < 2 || data[0] != 0xA1 || data[1] < 0x20 || 0x3F < data[1]){
+    return false;
+  }
+  report->id = data[1];
+  const report_layout_t *layout = &report_layouts[data[1] - 0x20];
+  if(layout->buttons && (size_t)(layout->buttons + 2) <= len){
+    report->has_buttons = true;
+    report->buttons = (data[2] << 8 | data[3]) & 0x1F9F;
+  }
+  if(layout->accel && (size_t)(layout->accel + 3) <= len){
+    report->has_accel = true;
+    report->accel[0] = data[layout->accel  ] << 2 | (data[2] >> 5 & 0x03);
+    report->accel[1] = data[layout->accel+1] << 2 | (data[3] >> 4 & 0x02);
+    report->accel[2] = data[layout->accel+2] << 2 | (data[3] >> 5 & 0x02);
+  }
+  if(layout->ir && (size_t)(layout->ir + layout->ir_len) <= len){
+    report->ir = data + layout->ir;
+    report->ir_len = layout->ir_len;
+  }
+  if(layout->ext && (size_t)(layout->ext + layout->ext_len) <= len){
+    report->ext = data + layout->ext;
+    report->ext_len = layout->ext_len;
+  }
+  return true;
+}
+
+static void state_publish(connection_t *c, const wiimote_report_t *report){
+  state_snapshot_t *snapshot = &state_list[c - connection_list];
+  uint32_t latest = snapshot->latest.load(std::memory_order_relaxed);
+  const wiimote_state_t *prev = &snapshot->buffer[latest].state;
+  state_buffer_t *next = &snapshot->buffer[latest ^ 1];
+
+  uint32_t seq = next->seq.load(std::memory_order_relaxed);
+  next->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  next->connection_handle = c->connection_handle;
+  wiimote_state_t *state = &next->state;
+  *state = *prev; // fields the report does not carry keep their last value
+  state->sequence++;
+  state->timestamp = (uint32_t)report->timestamp;
+  state->report_id = report->id;
+  if(report->has_buttons){
+    state->buttons = report->buttons;
+  }
+  if(report->has_accel_mg){
+    state->has_accel_mg = true;
+    memcpy(state->accel_mg, report->accel_mg, sizeof(state->accel_mg));
+  }
+  if(report->ir_blobs){
+    state->has_pointer = report->has_pointer;
+    memcpy(state->pointer, report->pointer, sizeof(state->pointer));
+  }
+  if(report->ext){
+    state->ext_len = report->ext_len;
+    memcpy(state->ext, report->ext, report->ext_len);
+  }
+  if(report->has_weight){
+    state->has_weight = true;
+    memcpy(state->weight, report->weight, sizeof(state->weight));
+    state->total_weight = report->total_weight;
+    state->has_cop = report->has_cop;
+    memcpy(state->cop, report->cop, sizeof(state->cop));
+  }
+
+  next->seq.store(seq + 2, std::memory_order_release);
+  snapshot->latest.store(latest ^ 1, std::memory_order_release);
+}
+
+/**
+ * Latency
+ * rx_timestamp is the receive time of the packet being dispatched.
+ */
+static int64_t rx_timestamp = 0;
+
+static int latency_bucket(int64_t micros){
+  uint32_t us = micros < 0 ? 0 : micros < UINT32_MAX ? (uint32_t)micros : UINT32_MAX;
+  int bucket = 31 - __builtin_clz(us | 1);
+  return bucket < WIIMOTE_LATENCY_BUCKETS ? bucket : WIIMOTE_LATENCY_BUCKETS - 1;
+}
+static void latency_record(connection_t *c, int64_t timestamp){
+  c->latency.residency[latency_bucket(esp_timer_get_time() - timestamp)]++;
+  if(c->last_report_timestamp != 0){
+    c->latency.interval[latency_bucket(timestamp - c->last_report_timestamp)]++;
+  }
+  c->last_report_timestamp = timestamp;
+}
+
+// True if the report matches the last delivered one (of the same half in interleaved mode), apart from accelerometer noise.
+static bool report_filter_duplicate(report_filter_t *f, const wiimote_report_t *report, const uint8_t *data, uint16_t len){
+  if((f->report_ids >> (report->id - 0x20) & 1) == 0 || REPORT_MAX_SIZE < len){
+    return false;
+  }
+  const report_layout_t *layout = &report_layouts[report->id - 0x20];
+  uint8_t masked[REPORT_MAX_SIZE];
+  memcpy(masked, data, len);
+  if(layout->buttons){
+    masked[layout->buttons] = masked[layout->buttons+1] = 0;
+  }
+  if(layout->accel){
+    masked[layout->accel] = masked[layout->accel+1] = masked[layout->accel+2] = 0;
+  }
+
+  report_filter_last_t *last = &f->last[report->id == 0x3F];
+  bool duplicate = last->len == len && memcmp(last->data, masked, len) == 0 && last->buttons == report->buttons;
+  for(int axis=0; axis<3 && duplicate; axis++){
+    int delta = report->accel[axis] - last->accel[axis];
+    duplicate = (delta < 0 ? -delta : delta) <= f->accel_threshold;
+  }
+  if(duplicate){
+    f->suppressed++;
+    return true;
+  }
+  last->len = len;
+  memcpy(last->data, masked, len);
+  last->buttons = report->buttons;
+  memcpy(last->accel, report->accel, sizeof(last->accel));
+  return false;
+}
+
+static void process_report(uint16_t connection_handle, uint8_t* data, uint16_t len){
+  _trace(WIIMOTE_TRACE_REPORT, connection_handle, len, _trace_bytes(data, len));
+  current_report_ptr = Wiimote::decode_report(data, len, &current_report) ? &current_report : NULL;
+  current_report.timestamp = rx_timestamp;
+  connection_t *c = connection_find(connection_handle);
+  if(current_report_ptr && current_report.has_accel && c && c->accel_calibrated){
+    current_report.has_accel_mg = true;
+    accel_convert(&c->accel_calibration, current_report.accel, current_report.accel_mg);
+  }
+  if(current_report_ptr && current_report.ir && c){
+    ir_decode(c, &current_report);
+  }
+  if(current_report_ptr && current_report.ext && 8 <= current_report.ext_len && c && c->extension == EXTENSION_BALANCE_BOARD && c->balance_calibrated){
+    balance_process(c, current_report.ext, &current_report);
+  }
+  if(current_report_ptr && c){
+    state_publish(c, &current_report);
+  }
+  if(current_report_ptr && c && report_filter_duplicate(&c->report_filter, &current_report, data, len)){
+    current_report_ptr = NULL;
+    return;
+  }
+  if(current_report_ptr && c && 0x30 <= current_report.id){ // data reports, not status or memory answers
+    stat_add(stats.connection[c - connection_list].reports);
+    latency_record(c, rx_timestamp);
+  }
+  _singleton->_callback(WIIMOTE_EVENT_DATA, connection_handle, data, len);
+  current_report_ptr = NULL;
+}
+
+/**
+ * Extension controller
+ * Initialized by writing 0x55 to 0xA400F0 and 0x00 to 0xA400FB, then identified by the 6 bytes at 0xA400FA.
+ * The requests are queued back to back; each step runs from the completion of the one it depends on.
+ * With a device cache entry the reporting mode is selected right away and the queries only verify it.
+ */
+static void extension_balance_calibration_complete(uint16_t connection_handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx){
+  connection_t *c = connection_find(connection_handle);
+  if(!c){
     return;
   }
-  if(len != 0x08){
-    log_d("!!! len!=0x08");
+  c->extension_query = false;
+  if(error != WIIMOTE_MEMORY_OK){
+    log_d("balance calibration read failed error=%02X", error);
     return;
   }
-  if(data[8]==0x01 && data[9]==0x02){ // MTU
-    uint16_t mtu = (data[11] << 8) | data[10];
-    log_d("  MTU=%d", mtu);
-
-    int idx = l2cap_connection_find_by_local_cid(connection_handle, destination_cid);
-    struct l2cap_connection_t l2cap_connection = l2cap_connection_list[idx];
-
-    uint8_t  packet_boundary_flag = 0b10; // Packet_Boundary_Flag
-    uint8_t  broadcast_flag       = 0b00; // Broadcast_Flag
-    uint16_t channel_id           = 0x0001;
-    uint16_t source_cid           = l2cap_connection.remote_cid;
-    uint8_t data[] = {
-      0x05,       // CONFIGURATION RESPONSE
-      identifier, // Identifier
-      0x0A, 0x00, // Length: 0x000A
-      (uint8_t)(source_cid & 0xFF), (uint8_t)(source_cid >> 8), // Source CID
-      0x00, 0x00, // Flags
-      0x00, 0x00, // Res
-      0x01, 0x02, (uint8_t)(mtu & 0xFF), (uint8_t)(mtu >> 8) // type=01 len=02 value=xx xx
-    };
-    uint16_t data_len = 14;
-    uint16_t len = make_acl_l2cap_single_packet(tmp_data, connection_handle, packet_boundary_flag, broadcast_flag, channel_id, data, data_len);
-    _queue_data(_tx_queue, tmp_data, len); // TODO: check return
-    log_d("queued acl_l2cap_single_packet(CONFIGURATION RESPONSE)");
+  log_d("BALANCE CALIBRATION DATA len=%d data=%s", size, formatHex(data, size));
+  bool calibrated = c->balance_calibrated; // from the device cache, reporting mode already selected
+  balance_calibration_init(c, data);
+  if(!calibrated){
+    _select_reporting_mode(c);
+  }
+  device_cache_t cache = c->cache;
+  cache.extension = EXTENSION_BALANCE_BOARD;
+  cache.balance_calibrated = true;
+  memcpy(cache.balance_calibration_data, data, sizeof(cache.balance_calibration_data));
+  device_cache_update(c, &cache);
+}
 
-    if (l2cap_connection.initiator) {
-      if(l2cap_connection.psm == PSM_HID_Control_11){
-        _singleton->_callback(WIIMOTE_EVENT_NEW, connection_handle, NULL, 0);
-        _l2cap_connect(connection_handle, PSM_HID_Interrupt_13, _g_local_cid++);
-      } else
-      if(l2cap_connection.psm == PSM_HID_Interrupt_13){
-        _singleton->_callback(WIIMOTE_EVENT_CONNECT, connection_handle, NULL, 0);
-      }
-    } else {
-      _l2cap_configure(connection_handle, l2cap_connection.local_cid, mtu);
+static void extension_id_complete(uint16_t connection_handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx){
+  connection_t *c = connection_find(connection_handle);
+  if(!c){
+    return;
+  }
+  if(error != WIIMOTE_MEMORY_OK){
+    log_d("extension id read failed error=%02X", error);
+    c->extension_query = false;
+    return;
+  }
+  extension_type_t previous = c->extension;
+  if(memcmp(data, (const uint8_t[]){0x00, 0x00, 0xA4, 0x20, 0x00, 0x00}, 6)==0){ // Nunchuck
+    c->extension = EXTENSION_NUNCHUK;
+    c->extension_query = false;
+    if(previous != EXTENSION_NUNCHUK){
+      _select_reporting_mode(c);
+    }
+  }
+  else if(memcmp(data, (const uint8_t[]){0x00, 0x00, 0xA4, 0x20, 0x04, 0x02}, 6)==0){ // Wii Balance Board
+    c->extension = EXTENSION_BALANCE_BOARD;
+    if(previous != EXTENSION_BALANCE_BOARD){
+      c->balance_calibrated = false;
+    }
+    if(!_read_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xA40024, sizeof(c->balance_calibration_data), c->balance_calibration_data, extension_balance_calibration_complete)){
+      c->extension_query = false;
     }
   }
+  else {
+    c->extension = EXTENSION_OTHER;
+    c->extension_query = false;
+  }
+  if(c->extension != EXTENSION_BALANCE_BOARD){ // the board is stored with its calibration
+    device_cache_update_extension(c);
+  }
 }
 
-static void process_l2cap_connection_close(uint16_t connection_handle, uint8_t* data){
-    // [D][Wiimote.cpp:796] process_acl_data(): **** ACL_DATA len=16 data=81 20 0C 00 08 00 01 00 06 5C 04 00 32 00 7A 00 
-    // [D][Wiimote.cpp:789] process_l2cap_data():   ### process_l2cap_data no impl ###
-    // [D][Wiimote.cpp:790] process_l2cap_data():   L2CAP len=8 data=06 5C 04 00 32 00 7A 00 
-    // [D][Wiimote.cpp:796] process_acl_data(): **** ACL_DATA len=16 data=81 20 0C 00 08 00 01 00 06 5D 04 00 33 00 7B 00 
-    // [D][Wiimote.cpp:789] process_l2cap_data():   ### process_l2cap_data no impl ###
-    // [D][Wiimote.cpp:790] process_l2cap_data():   L2CAP len=8 data=06 5D 04 00 33 00 7B 00 
-
-  uint16_t source_cid = (data[ 5] << 8) | data[ 4];
-  uint16_t destination_cid = (data[ 7] << 8) | data[ 6];
-  log_d("L2CAP CONNECTION CLOSE");
-  log_d("  handle          = %02X", connection_handle);
-  log_d("  destination_cid = %04X", destination_cid);
-  log_d("  souce_cid       = %04X", source_cid);
-
-  int rel = l2cap_connection_remove(connection_handle, source_cid, destination_cid);
-  if(rel==-1)
-    log_d(" l2cap_connection_remove failed.");
-  else
-    log_d(" l2cap_connection_remove success, l2cap_connection_size = %d.", rel);
+static void extension_init_complete(uint16_t connection_handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx){
+  connection_t *c = connection_find(connection_handle);
+  if(c && error != WIIMOTE_MEMORY_OK){
+    // A1 22 00 00 16 04 => NG, the next status report retries
+    log_d("extension init failed error=%02X", error);
+    c->extension_query = false;
+  }
 }
 
-static void process_report(uint16_t connection_handle, uint8_t* data, uint16_t len){
-  log_d("REPORT len=%d data=%s", len, formatHex(data, len));
-  _singleton->_callback(WIIMOTE_EVENT_DATA, connection_handle, data, len);
+static void extension_query(connection_t *c){
+  uint16_t connection_handle = c->connection_handle;
+  // the remote serves requests in order, so the read sees both writes applied
+  if( _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xA400F0, 1, (const uint8_t[]){0x55}, extension_init_complete)
+   && _write_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xA400FB, 1, (const uint8_t[]){0x00}, extension_init_complete)
+   && _read_memory(connection_handle, WIIMOTE_CONTROL_REGISTER, 0xA400FA, sizeof(c->extension_id), c->extension_id, extension_id_complete)){
+    c->extension_query = true;
+  }
 }
 
 static void process_extension_controller_reports(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
-  static int controller_query_state = 0;
+  connection_t *c = connection_find(connection_handle);
+  if(!c){
+    return;
+  }
 
-  switch(controller_query_state){
-  case 0:
+  switch(data[1]){
+  case 0x20:
     // 0x20 Status
     // (a1) 20 BB BB LF 00 00 VV
-    if(data[1] == 0x20){
-      if(data[4] & 0x02){ // extension controller is connected
-        _write_memory(connection_handle, CONTROL_REGISTER, 0xA400F0, 1, (const uint8_t[]){0x55});
-        controller_query_state = 1;
-      }else{ // extension controller is NOT connected
-        _set_reporting_mode(connection_handle, 0x30, false); // 0x30: Core Buttons : 30 BB BB
-        //_set_reporting_mode(connection_handle, 0x31, false); // 0x31: Core Buttons and Accelerometer : 31 BB BB AA AA AA
-      }
-    }
-    break;
-  case 1:
-    // A1 22 00 00 16 00 => OK
-    // A1 22 00 00 16 04 => NG
-    if(data[1]==0x22 && data[4]==0x16){
-      if(data[5]==0x00){
-        _write_memory(connection_handle, CONTROL_REGISTER, 0xA400FB, 1, (const uint8_t[]){0x00});
-        controller_query_state = 2;
-      }else{
-        controller_query_state = 0;
-      }
+    if(len < 5){
+      break;
     }
-    break;
-  case 2:
-    if(data[1]==0x22 && data[4]==0x16){
-      if(data[5]==0x00){
-        _read_memory(connection_handle, CONTROL_REGISTER, 0xA400FA, 6); // read controller type
-        controller_query_state = 3;
-      }else{
-        controller_query_state = 0;
+    if(data[4] & 0x02){ // extension controller is connected
+      if(!c->extension_query){
+        extension_query(c);
+        // an unrequested status report stops data reports until the mode is set again
+        if(c->extension == EXTENSION_NUNCHUK || (c->extension == EXTENSION_BALANCE_BOARD && c->balance_calibrated)){
+          _select_reporting_mode(c);
+        }
       }
+    }else{ // extension controller is NOT connected
+      c->extension = EXTENSION_NONE;
+      _select_reporting_mode(c);
+      device_cache_update_extension(c);
     }
     break;
-  case 3:
+  case 0x21:
     // 0x21 Read response
     // (a1) 21 BB BB SE FF FF DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD DD
-    if(data[1] == 0x21){
-      if(memcmp(data+5, (const uint8_t[]){0x00, 0xFA}, 2)==0){
-        if(memcmp(data+7, (const uint8_t[]){0x00, 0x00, 0xA4, 0x20, 0x00, 0x00}, 6)==0){ // Nunchuck
-          _set_reporting_mode(connection_handle, 0x32, false); // 0x32: Core Buttons with 8 Extension bytes : 32 BB BB EE EE EE EE EE EE EE EE
-        }
-        if(memcmp(data+7, (const uint8_t[]){0x00, 0x00, 0xA4, 0x20, 0x04, 0x02}, 6)==0){ // Wii Balance Board
-          _read_memory(connection_handle, CONTROL_REGISTER, 0xA40024, 16); // read calibration 0 kg and 17kg
-
-          controller_query_state = 4;
-        }
-        else {
-          controller_query_state = 0;
-        } 
-      }
-    }
+    process_memory_read_data(c, data, len);
     break;
-  case 4:
-  {
-      log_d("BALANCE CALIBRATION DATA 1 len=%d data=%s", len, formatHex(data, len));
-      uint8_t* cal = data+7;
-      balance_calibration[0] = cal[0] * 256 + cal[1];//Top Right 0kg 
-      balance_calibration[1] = cal[2] * 256 + cal[3]; //Bottom Right 0kg
-      balance_calibration[2] = cal[4] * 256 + cal[5]; //Top Left 0kg
-      balance_calibration[3] = cal[6] * 256 + cal[7]; //Bottom Left 0kg
-
-      balance_calibration[4] = cal[8] * 256 + cal[9];//Top Right 17kg 
-      balance_calibration[5] = cal[10] * 256 + cal[11];//Bottom Right 17kg
-      balance_calibration[6] = cal[12] * 256 + cal[13];//Top Left 17kg
-      balance_calibration[7] = cal[14] * 256 + cal[15];//Bottom Left 17kg
-      
-      _read_memory(connection_handle, CONTROL_REGISTER, 0xA40034, 8); // read calibration 34kg
-
-      controller_query_state = 5;
-    }
-    break;
-    case 5: 
-    {
-      log_d("BALANCE CALIBRATION DATA 2 len=%d data=%s", len, formatHex(data, len));
-      uint8_t* cal = data+7;
-      balance_calibration[8] = cal[0] * 256 + cal[1];//Top Right 34kg 
-      balance_calibration[9] = cal[2] * 256 + cal[3]; //Bottom Right 34kg
-      balance_calibration[10] = cal[4] * 256 + cal[5]; //Top Left 34kg
-      balance_calibration[11] = cal[6] * 256 + cal[7]; //Bottom Left 34kg
-
-      _set_reporting_mode(connection_handle, 0x34, false); // 0x34: Core Buttons with 19 Extension bytes : 34 BB BB EE EE EE EE EE EE EE EE EE EE EE EE EE EE EE EE EE EE EE
-
-      controller_query_state = 0;
-    }
+  case 0x22:
+    // A1 22 00 00 16 00 => OK
+    process_memory_write_ack(c, data, len);
     break;
   }
 }
 
-static void process_l2cap_data(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
-  if(data[0]==0x02){ // CONNECTION REQUEST
-    process_l2cap_connection_request(connection_handle, data);
-  }else
-  if(data[0]==0x03){ // CONNECTION RESPONSE
-    process_l2cap_connection_response(connection_handle, data);
-  }else
-  if(data[0]==0x05){ // CONFIGURATION RESPONSE
-    process_l2cap_configuration_response(connection_handle, data);
-  }else
-  if(data[0]==0x04){ // CONFIGURATION REQUEST
-    process_l2cap_configuration_request(connection_handle, data);
-  }else
+static void process_hid_data(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
   if(data[0]==0xA1){ // HID 0xA1
     process_extension_controller_reports(connection_handle, channel_id, data, len);
     process_report(connection_handle, data, len);
-  }else
-  if(data[0]==0x06){ // CONNECTION CLOSING ? (Aqee)
-    process_l2cap_connection_close(connection_handle, data);
   }else{
-    log_d("  ### process_l2cap_data no impl ###");
-    log_d("  L2CAP len=%d data=%s", len, formatHex(data, len));
+    stat_add(stats.unhandled);
+    log_d("  ### process_hid_data no impl ###");
+    log_d("  HID len=%d data=%s", len, formatHex(data, len));
   }
 }
 
-static void process_acl_data(uint8_t* data, size_t len){
-  if(data[0]!=0xA1){
-    log_d("**** ACL_DATA len=%d data=%s", len, formatHex(data, len));
+static void process_l2cap_no_impl(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
+  stat_add(stats.unhandled);
+  log_d("  ### process_l2cap_data no impl ###");
+  log_d("  L2CAP len=%d data=%s", len, formatHex(data, len));
+}
+
+/**
+ * L2CAP dispatch
+ * Signaling (CID 0x0001) is indexed by command code, every other channel by HID transaction type (data[0] >> 4).
+ */
+typedef void (* l2cap_handler_t)(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len);
+#define L2CAP_SIGNALING_TABLE_SIZE 0x0C
+static const l2cap_handler_t l2cap_signaling_handlers[L2CAP_SIGNALING_TABLE_SIZE] = {
+  process_l2cap_no_impl,                 // 0x00
+  process_l2cap_no_impl,                 // 0x01 COMMAND REJECT
+  process_l2cap_connection_request,      // 0x02 CONNECTION REQUEST
+  process_l2cap_connection_response,     // 0x03 CONNECTION RESPONSE
+  process_l2cap_configuration_request,   // 0x04 CONFIGURATION REQUEST
+  process_l2cap_configuration_response,  // 0x05 CONFIGURATION RESPONSE
+  process_l2cap_connection_close,        // 0x06 DISCONNECTION REQUEST
+  process_l2cap_no_impl,                 // 0x07 DISCONNECTION RESPONSE
+  process_l2cap_no_impl,                 // 0x08 ECHO REQUEST
+  process_l2cap_no_impl,                 // 0x09 ECHO RESPONSE
+  process_l2cap_no_impl,                 // 0x0A INFORMATION REQUEST
+  process_l2cap_no_impl,                 // 0x0B INFORMATION RESPONSE
+};
+static const l2cap_handler_t l2cap_hid_handlers[16] = {
+  process_l2cap_no_impl,                 // 0x0? HANDSHAKE
+  process_l2cap_no_impl,                 // 0x1? HID_CONTROL
+  process_l2cap_no_impl,                 // 0x2?
+  process_l2cap_no_impl,                 // 0x3?
+  process_l2cap_no_impl,                 // 0x4? GET_REPORT
+  process_l2cap_no_impl,                 // 0x5? SET_REPORT
+  process_l2cap_no_impl,                 // 0x6? GET_PROTOCOL
+  process_l2cap_no_impl,                 // 0x7? SET_PROTOCOL
+  process_l2cap_no_impl,                 // 0x8?
+  process_l2cap_no_impl,                 // 0x9?
+  process_hid_data,                      // 0xA? DATA
+  process_l2cap_no_impl,                 // 0xB?
+  process_l2cap_no_impl,                 // 0xC?
+  process_l2cap_no_impl,                 // 0xD?
+  process_l2cap_no_impl,                 // 0xE?
+  process_l2cap_no_impl,                 // 0xF?
+};
+
+static void process_l2cap_data(uint16_t connection_handle, uint16_t channel_id, uint8_t* data, uint16_t len){
+  if(len == 0){
+    process_l2cap_no_impl(connection_handle, channel_id, data, len);
+  }else if(channel_id != 0x0001){
+    l2cap_hid_handlers[data[0] >> 4](connection_handle, channel_id, data, len);
+  }else if(data[0] < L2CAP_SIGNALING_TABLE_SIZE){
+    l2cap_signaling_handlers[data[0]](connection_handle, channel_id, data, len);
+  }else{
+    process_l2cap_no_impl(connection_handle, channel_id, data, len);
+  }
+}
+
+// Appends an ACL fragment to the connection's frame buffer and dispatches the frame once complete.
+static void process_acl_fragment(connection_t *c, bool first, uint8_t *fragment, uint16_t fragment_len){
+  if(first){
+    if(c->rx_frame_len != 0){
+      log_d("!!! start before the frame was complete, partial frame dropped");
+      stat_add(stats.rx_dropped);
+    }
+    c->rx_frame_len = 0;
+  }else if(c->rx_frame_len == 0){
+    log_d("!!! continuation without start, dropped");
+    stat_add(stats.rx_dropped);
+    return;
+  }
+  if(sizeof(c->rx_frame) - c->rx_frame_len < fragment_len){
+    log_d("!!! L2CAP frame larger than MTU, dropped");
+    stat_add(stats.rx_dropped);
+    c->rx_frame_len = 0;
+    return;
+  }
+  memcpy(c->rx_frame + c->rx_frame_len, fragment, fragment_len);
+  c->rx_frame_len += fragment_len;
+  if(c->rx_frame_len < L2CAP_HEADER_SIZE){
+    return;
+  }
+  uint16_t l2cap_len  = (c->rx_frame[1] << 8) | c->rx_frame[0];
+  uint16_t channel_id = (c->rx_frame[3] << 8) | c->rx_frame[2];
+  if(c->rx_frame_len < L2CAP_HEADER_SIZE + l2cap_len){
+    return;
   }
+  c->rx_frame_len = 0;
+  process_l2cap_data(c->connection_handle, channel_id, c->rx_frame + L2CAP_HEADER_SIZE, l2cap_len);
+}
 
+static void process_acl_data(uint8_t* data, size_t len){
+  if(len < 4){
+    log_d("!!! ACL data shorter than its header");
+    return;
+  }
   uint16_t connection_handle    = ((data[1] & 0x0F) << 8) | data[0];
+  _trace(WIIMOTE_TRACE_ACL_DATA, connection_handle, len, _trace_bytes(data + 8, len < 8 ? 0 : len - 8));
+
   uint8_t  packet_boundary_flag =  (data[1] & 0x30) >> 4; // Packet_Boundary_Flag
   uint8_t  broadcast_flag       =  (data[1] & 0xC0) >> 6; // Broadcast_Flag
   uint16_t acl_len              =  (data[3] << 8) | data[2];
-  if(packet_boundary_flag != 0b10){
+  if(broadcast_flag != 0b00){
+    log_d("!!! broadcast_flag = 0b%02B", broadcast_flag);
+    return;
+  }
+  if(len < 4u + acl_len){
+    log_d("!!! ACL data shorter than its Data_Total_Length");
+    return;
+  }
+  if(packet_boundary_flag != 0b10 && packet_boundary_flag != 0b01){
     log_d("!!! packet_boundary_flag = 0b%02B", packet_boundary_flag);
     return;
   }
-  if(broadcast_flag != 0b00){
-    log_d("!!! broadcast_flag = 0b%02B", broadcast_flag);
+  connection_t *c = connection_find(connection_handle);
+
+  // a complete frame in one packet is dispatched in place
+  if(packet_boundary_flag == 0b10 && L2CAP_HEADER_SIZE <= acl_len){
+    uint16_t l2cap_len  = (data[5] << 8) | data[4];
+    uint16_t channel_id = (data[7] << 8) | data[6];
+    if(acl_len == L2CAP_HEADER_SIZE + l2cap_len){
+      if(c && c->rx_frame_len != 0){
+        log_d("!!! start before the frame was complete, partial frame dropped");
+        stat_add(stats.rx_dropped);
+        c->rx_frame_len = 0;
+      }
+      process_l2cap_data(connection_handle, channel_id, data + 8, l2cap_len);
+      return;
+    }
+  }
+  if(!c){
+    log_d("!!! fragment for unknown handle, dropped");
     return;
   }
-  uint16_t l2cap_len            =  (data[5] << 8) | data[4];
-  uint16_t channel_id           =  (data[7] << 8) | data[6];
+  process_acl_fragment(c, packet_boundary_flag == 0b10, data + 4, acl_len);
+}
+
+static void process_number_of_completed_packets_event(uint8_t len, uint8_t* data){
+  uint8_t num = data[0];
+  for(int i=0; i<num; i++){
+    uint8_t *p = data + 1 + 4*i;
+    uint16_t connection_handle = ((p[1] & 0x0F) << 8) | p[0];
+    uint16_t count             =  (p[3] << 8) | p[2];
+    acl_credit_return(connection_handle, count);
+  }
+}
+
+static void process_qos_setup_complete_event(uint8_t len, uint8_t* data){
+  log_d("  (QoS Setup Complete Event)");
+}
 
-  process_l2cap_data(connection_handle, channel_id, data + 8, l2cap_len);
+static void process_hci_event_no_impl(uint8_t len, uint8_t* data){
+  stat_add(stats.unhandled);
+  log_d("  ### process_hci_event no impl ###");
 }
 
+/**
+ * HCI event dispatch, indexed by event code
+ */
+typedef void (* hci_event_handler_t)(uint8_t len, uint8_t* data);
+#define HCI_EVENT_TABLE_SIZE 0x40
+static const hci_event_handler_t hci_event_handlers[HCI_EVENT_TABLE_SIZE] = {
+  process_hci_event_no_impl,                  // 0x00
+  process_inquiry_complete_event,             // 0x01 Inquiry Complete
+  process_inquiry_result_event,               // 0x02 Inquiry Result
+  process_connection_complete_event,          // 0x03 Connection Complete
+  process_connection_request_event,           // 0x04 Connection Request
+  process_disconnection_complete_event,       // 0x05 Disconnection Complete
+  process_authentication_complete_event,      // 0x06 Authentication Complete
+  process_remote_name_request_complete_event, // 0x07 Remote Name Request Complete
+  process_hci_event_no_impl,                  // 0x08 Encryption Change
+  process_hci_event_no_impl,                  // 0x09
+  process_hci_event_no_impl,                  // 0x0A
+  process_hci_event_no_impl,                  // 0x0B
+  process_hci_event_no_impl,                  // 0x0C
+  process_qos_setup_complete_event,           // 0x0D QoS Setup Complete
+  process_command_complete_event,             // 0x0E Command Complete
+  process_command_status_event,               // 0x0F Command Status
+  process_hci_event_no_impl,                  // 0x10
+  process_hci_event_no_impl,                  // 0x11
+  process_hci_event_no_impl,                  // 0x12 Role Change
+  process_number_of_completed_packets_event,  // 0x13 Number Of Completed Packets
+  process_hci_event_no_impl,                  // 0x14 Mode Change
+  process_hci_event_no_impl,                  // 0x15
+  process_pin_request_event,                  // 0x16 PIN Code Request
+  process_link_key_request_event,             // 0x17 Link Key Request
+  process_link_key_notification_event,        // 0x18 Link Key Notification
+  process_hci_event_no_impl,                  // 0x19
+  process_hci_event_no_impl,                  // 0x1A
+  process_hci_event_no_impl,                  // 0x1B
+  process_hci_event_no_impl,                  // 0x1C
+  process_hci_event_no_impl,                  // 0x1D
+  process_hci_event_no_impl,                  // 0x1E
+  process_hci_event_no_impl,                  // 0x1F
+  process_hci_event_no_impl,                  // 0x20
+  process_hci_event_no_impl,                  // 0x21
+  process_inquiry_result_with_rssi_event,     // 0x22 Inquiry Result with RSSI
+  process_hci_event_no_impl,                  // 0x23
+  process_hci_event_no_impl,                  // 0x24
+  process_hci_event_no_impl,                  // 0x25
+  process_hci_event_no_impl,                  // 0x26
+  process_hci_event_no_impl,                  // 0x27
+  process_hci_event_no_impl,                  // 0x28
+  process_hci_event_no_impl,                  // 0x29
+  process_hci_event_no_impl,                  // 0x2A
+  process_hci_event_no_impl,                  // 0x2B
+  process_hci_event_no_impl,                  // 0x2C
+  process_hci_event_no_impl,                  // 0x2D
+  process_hci_event_no_impl,                  // 0x2E
+  process_extended_inquiry_result_event,      // 0x2F Extended Inquiry Result
+  process_hci_event_no_impl,                  // 0x30
+  process_hci_event_no_impl,                  // 0x31
+  process_hci_event_no_impl,                  // 0x32
+  process_hci_event_no_impl,                  // 0x33
+  process_hci_event_no_impl,                  // 0x34
+  process_hci_event_no_impl,                  // 0x35
+  process_hci_event_no_impl,                  // 0x36
+  process_hci_event_no_impl,                  // 0x37
+  process_hci_event_no_impl,                  // 0x38
+  process_hci_event_no_impl,                  // 0x39
+  process_hci_event_no_impl,                  // 0x3A
+  process_hci_event_no_impl,                  // 0x3B
+  process_hci_event_no_impl,                  // 0x3C
+  process_hci_event_no_impl,                  // 0x3D
+  process_hci_event_no_impl,                  // 0x3E
+  process_hci_event_no_impl,                  // 0x3F
+};
+
 static void process_hci_event(uint8_t event_code, uint8_t len, uint8_t* data){
-  if(event_code != 0x02){ // suppress inquiry_result_event
-    log_d("**** HCI_EVENT code=%02X len=%d data=%s", event_code, len, formatHex(data, len));
-  }
-
-  if(event_code == 0x0E){
-    process_command_complete_event(len, data);
-  }else if(event_code == 0x0F){
-    process_command_status_event(len, data);
-  }else if(event_code == 0x02){
-    process_inquiry_result_event(len, data);
-  }else if(event_code == 0x01){
-    process_inquiry_complete_event(len, data);
-  }else if(event_code == 0x07){
-    process_remote_name_request_complete_event(len, data);
-  }else if(event_code == 0x03){
-    process_connection_complete_event(len, data);
-  }else if(event_code == 0x04){
-    process_connection_request_event(len, data);
-  }else if(event_code == 0x05){
-    process_disconnection_complete_event(len, data);
-  }else if (event_code == 0x17){
-    process_link_key_request_event(len, data);
-  }else if (event_code == 0x16){
-    process_pin_request_event(len, data);
-  }else if(event_code == 0x13){
-    log_d("  (Number Of Completed Packets Event)");
-  }else if(event_code == 0x0D){
-    log_d("  (QoS Setup Complete Event)");
-  }else{
-    log_d("  ### process_hci_event no impl ###");
+  _trace(WIIMOTE_TRACE_HCI_EVENT, event_code, len, _trace_bytes(data, len));
+  if(event_code < WIIMOTE_STATS_HCI_EVENTS){
+    stat_add(stats.hci_events[event_code]);
   }
+
+  hci_event_handler_t handler = event_code < HCI_EVENT_TABLE_SIZE ? hci_event_handlers[event_code] : process_hci_event_no_impl;
+  handler(len, data);
 }
 
 float balance_interpolate(uint8_t pos, uint16_t *values, uint16_t *cal) {
@@ -1107,16 +3125,15 @@ void Wiimote::init(wiimote_callback_t cb){
   _singleton = this;
 
   this->_wiimote_callback = cb;
-  l2cap_connection_clear();
-
-  _tx_queue = xQueueCreate(TX_QUEUE_SIZE, sizeof(lendata_t*));
-  if (_tx_queue == NULL){
-    log_e("xQueueCreate(_tx_queue) failed");
-    return;
-  }
-  _rx_queue = xQueueCreate(RX_QUEUE_SIZE, sizeof(lendata_t*));
-  if (_rx_queue == NULL){
-    log_e("xQueueCreate(_rx_queue) failed");
+  connection_clear();
+  requested_connection_clear();
+  stats_clear();
+
+  tx_slot_pool_init(&_cmd_pool, cmd_slots, CMD_SLOT_COUNT);
+  tx_slot_pool_init(&_acl_pool, acl_slots, ACL_SLOT_COUNT);
+  hci_command_clear();
+  if(!lendata_ring_init(&_rx_ring, RX_RING_SIZE)){
+    log_e("lendata_ring_init(_rx_ring) failed");
     return;
   }
 
@@ -1135,41 +3152,179 @@ void Wiimote::init(wiimote_callback_t cb){
   _reset();
 }
 
+static void _send(uint8_t *data, uint16_t len){
+  esp_vhci_host_send_packet(data, len);
+  _capture(false, data, len, esp_timer_get_time());
+  stat_add(stats.tx_packets);
+  stat_add(stats.tx_bytes, len);
+  _trace(WIIMOTE_TRACE_SEND, len, _trace_bytes(data, len), _trace_bytes(data + 4, len < 4 ? 0 : len - 4));
+}
+
+static void _handle_memory_timeout(void){
+  int64_t now = esp_timer_get_time();
+  for(int i=0; i<CONNECTION_LIST_SIZE; i++){
+    if(connection_list[i].used && 0 < connection_list[i].memory_request_list_size){
+      memory_request_expire(&connection_list[i], now);
+    }
+  }
+}
+
+static bool _handle_cmd_tx(void){
+  if(0 < hci_command_list_size){
+    hci_command_expire(esp_timer_get_time());
+  }
+  tx_slot_t *slot = tx_slot_peek(&_cmd_pool);
+  if(!slot || hci_command_credits == 0 || hci_command_list_size == HCI_COMMAND_LIST_SIZE){
+    return false;
+  }
+  if(!esp_vhci_host_check_send_available()){
+    return false;
+  }
+  struct hci_command_t hci_command;
+  hci_command.opcode   = (slot->data[2] << 8) | slot->data[1];
+  hci_command.complete = slot->complete;
+  hci_command.sent     = esp_timer_get_time();
+  if(hci_command_add(hci_command) == -1){
+    log_d("!!! hci_command_add failed.");
+  }
+  hci_command_credits--;
+  _send(slot->data, slot->len);
+  tx_slot_release(&_cmd_pool);
+  return true;
+}
+
+// The oldest packet of a link that has used up its credits waits, and the packets of other links behind
+// it go first. Packets of one link stay in order.
+static bool _handle_acl_tx(void){
+  uint16_t blocked[CONNECTION_LIST_SIZE];
+  int blocked_count = 0;
+  tx_slot_t *slot;
+  uint16_t connection_handle = 0;
+  for(uint32_t i=0; (slot = tx_slot_at(&_acl_pool, i)); i++){
+    if(slot->sent){
+      continue;
+    }
+    connection_handle = ((slot->data[2] & 0x0F) << 8) | slot->data[1];
+    bool waiting = false;
+    for(int b=0; b<blocked_count; b++){
+      waiting |= blocked[b] == connection_handle;
+    }
+    if(waiting){
+      continue;
+    }
+    if(acl_credit_available(connection_handle)){
+      break;
+    }
+    if(acl_credits == 0 || blocked_count == CONNECTION_LIST_SIZE){
+      return false;
+    }
+    blocked[blocked_count++] = connection_handle;
+  }
+  if(!slot){
+    return false;
+  }
+  if(!esp_vhci_host_check_send_available()){
+    return false;
+  }
+  acl_credit_take(connection_handle);
+
+  // An L2CAP frame longer than the controller's ACL buffer goes out as a start packet and continuation
+  // packets (one credit each). Each continuation header is written over bytes that have already been sent.
+  uint16_t frame_len = slot->len - HCI_H4_ACL_PREAMBLE_SIZE;
+  uint16_t max_len   = HCI_H4_ACL_PREAMBLE_SIZE < acl_data_packet_length ? acl_data_packet_length : frame_len;
+  uint16_t chunk_len = frame_len - slot->offset < max_len ? frame_len - slot->offset : max_len;
+  uint8_t *packet    = slot->data + slot->offset;
+  if(slot->offset != 0){
+    packet[0] = H4_TYPE_ACL;
+    packet[1] = connection_handle & 0xFF;
+    packet[2] = ((connection_handle >> 8) & 0x0F) | 0b01 << 4; // continuation
+  }
+  packet[3] = chunk_len & 0xFF;
+  packet[4] = chunk_len >> 8;
+  _send(packet, HCI_H4_ACL_PREAMBLE_SIZE + chunk_len);
+
+  slot->offset += chunk_len;
+  if(slot->offset == frame_len){
+    tx_slot_sent(&_acl_pool, slot);
+  }
+  return true;
+}
+
+static bool _handle_tx(void){
+  return _handle_cmd_tx() || _handle_acl_tx();
+}
+
+static bool _handle_rx(void){
+  lendata_t *lendata = lendata_ring_peek(&_rx_ring);
+  if(!lendata){
+    return false;
+  }
+  rx_timestamp = lendata->timestamp;
+  switch(lendata->data[0]){
+  case 0x04:
+    process_hci_event(lendata->data[1], lendata->data[2], lendata->data+3);
+    break;
+  case 0x02:
+    process_acl_data(lendata->data+1, lendata->len-1);
+    break;
+  default:
+    log_d("**** !!! Not HCI Event !!! ****");
+    log_d("len=%d data=%s", (int)lendata->len, formatHex(lendata->data, lendata->len));
+  }
+  lendata_ring_release(&_rx_ring, lendata);
+  return true;
+}
+
+// Run at the end of every handle() call, whichever variant. NVS writes wait until the RX backlog is drained.
+static void _handle_deferred(void){
+  _handle_memory_timeout();
+  if(lendata_ring_count(&_rx_ring) == 0){
+    device_cache_flush();
+    link_key_flush();
+  }
+}
+
 void Wiimote::handle(){
   if(this != _singleton){ return; }
   if(!btStarted()){
     return;
   }
 
-  if(uxQueueMessagesWaiting(_tx_queue)){
-    bool ok = esp_vhci_host_check_send_available();
-    if(ok){
-      lendata_t *lendata = NULL;
-      if(xQueueReceive(_tx_queue, &lendata, 0) == pdTRUE){
-        esp_vhci_host_send_packet(lendata->data, lendata->len);
-        log_d("SEND => %s", formatHex(lendata->data, lendata->len));
-        free(lendata);
-      }
-    }
+  _handle_tx();
+  _handle_rx();
+  _handle_deferred();
+}
+
+int Wiimote::handle(uint16_t max_packets, uint32_t max_micros){
+  if(this != _singleton){ return 0; }
+  if(!btStarted()){
+    return 0;
   }
 
-  if(uxQueueMessagesWaiting(_rx_queue)){
-    lendata_t *lendata = NULL;
-    if(xQueueReceive(_rx_queue, &lendata, 0) == pdTRUE){
-      switch(lendata->data[0]){
-      case 0x04:
-        process_hci_event(lendata->data[1], lendata->data[2], lendata->data+3);
-        break;
-      case 0x02:
-        process_acl_data(lendata->data+1, lendata->len-1);
-        break;
-      default:
-        log_d("**** !!! Not HCI Event !!! ****");
-        log_d("len=%d data=%s", lendata->len, formatHex(lendata->data, lendata->len));
-      }
-      free(lendata);
+  // TX and RX are alternated so replies queued while processing RX go out within the same call.
+  // Without limits only the RX backlog present now is taken, so continuous traffic can't keep the call going.
+  int64_t start = esp_timer_get_time();
+  uint32_t done = 0;
+  uint32_t rx_left = max_packets == 0 && max_micros == 0 ? lendata_ring_count(&_rx_ring) : UINT32_MAX;
+  while(max_packets == 0 || done < max_packets){
+    bool sent = _handle_tx();
+    done += sent;
+    if(max_packets != 0 && max_packets <= done){
+      break;
+    }
+    bool received = rx_left != 0 && _handle_rx();
+    done += received;
+    rx_left -= received;
+    if(!sent && !received){
+      break;
+    }
+    if(max_micros != 0 && max_micros <= esp_timer_get_time() - start){
+      break;
     }
   }
+  _handle_deferred();
+
+  return tx_slot_count(&_cmd_pool) + tx_slot_count(&_acl_pool) + lendata_ring_count(&_rx_ring);
 }
 
 void Wiimote::scan(bool enable){
@@ -1182,6 +3337,12 @@ void Wiimote::scan(bool enable){
   }
 }
 
+void Wiimote::set_inquiry(uint8_t length, uint8_t max_responses, wiimote_inquiry_mode_t mode){
+  inquiry_length = length < 1 ? 1 : 0x30 < length ? 0x30 : length;
+  inquiry_max_responses = max_responses;
+  inquiry_mode = mode;
+}
+
 void Wiimote::_callback(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len){
   if(this != _singleton){ return; }
 
@@ -1198,11 +3359,202 @@ void Wiimote::set_rumble(uint16_t handle, bool rumble){
   _set_rumble(handle, rumble);
 }
 
+void Wiimote::set_accelerometer(uint16_t handle, bool enable){
+  connection_t *c = connection_find(handle);
+  if(!c){
+    return;
+  }
+  c->accel_enabled = enable;
+  _select_reporting_mode(c);
+}
+
+void Wiimote::set_ir(uint16_t handle, wiimote_ir_mode_t mode, uint8_t sensitivity){
+  connection_t *c = connection_find(handle);
+  if(!c){
+    return;
+  }
+  _ir_enable(c, mode, sensitivity);
+  _select_reporting_mode(c);
+}
+
+void Wiimote::set_report_filter(uint16_t handle, uint32_t report_ids, uint16_t accel_threshold){
+  connection_t *c = connection_find(handle);
+  if(!c){
+    return;
+  }
+  c->report_filter.report_ids = report_ids;
+  c->report_filter.accel_threshold = accel_threshold;
+  c->report_filter.last[0].len = c->report_filter.last[1].len = 0; // next report is delivered
+}
+
+void Wiimote::set_balance_filter(uint16_t handle, uint8_t smoothing, bool median, bool zero_tracking){
+  connection_t *c = connection_find(handle);
+  if(!c){
+    return;
+  }
+  balance_filter_t *f = &c->balance_filter;
+  f->smoothing = smoothing < 16 ? smoothing : 16;
+  f->median = median;
+  f->zero_tracking = zero_tracking;
+  f->primed = false; // restart from the next sample
+}
+
+bool Wiimote::tare_balance(uint16_t handle){
+  connection_t *c = connection_find(handle);
+  if(!c || c->extension != EXTENSION_BALANCE_BOARD || !c->balance_calibrated){
+    return false;
+  }
+  memcpy(c->balance_filter.tare, c->balance_filter.filtered, sizeof(c->balance_filter.tare));
+  return true;
+}
+
+// Looks the handle up in the snapshots themselves: connection_index and connection_list belong to handle()'s task.
+bool Wiimote::get_state(uint16_t handle, wiimote_state_t *state){
+  if(handle == 0){
+    return false;
+  }
+  for(int i=0; i<CONNECTION_LIST_SIZE; i++){
+    state_snapshot_t *snapshot = &state_list[i];
+    for(;;){
+      state_buffer_t *buffer = &snapshot->buffer[snapshot->latest.load(std::memory_order_acquire)];
+      uint32_t seq = buffer->seq.load(std::memory_order_acquire);
+      if(seq & 1){
+        continue;
+      }
+      bool match = buffer->connection_handle == handle;
+      if(match){
+        memcpy(state, &buffer->state, sizeof(wiimote_state_t));
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(buffer->seq.load(std::memory_order_relaxed) == seq){
+        if(match){
+          return true;
+        }
+        break;
+      }
+    }
+  }
+  return false;
+}
+
+bool Wiimote::read_memory(uint16_t handle, wiimote_address_space_t space, uint32_t offset, uint16_t size, uint8_t *buffer, wiimote_memory_callback_t callback, void *ctx){
+  return _read_memory(handle, space, offset, size, buffer, callback, ctx);
+}
+
+bool Wiimote::write_memory(uint16_t handle, wiimote_address_space_t space, uint32_t offset, uint16_t size, const uint8_t *data, wiimote_memory_callback_t callback, void *ctx){
+  return _write_memory(handle, space, offset, size, data, callback, ctx);
+}
+
+bool Wiimote::set_capture(bool enable){
+  if(enable && !capture_list){
+    capture_list = (capture_record_t*)malloc(sizeof(capture_record_t) * WIIMOTE_CAPTURE_SIZE);
+    if(!capture_list){
+      log_e("capture malloc failed");
+      return false;
+    }
+  }
+  portENTER_CRITICAL(&capture_mux);
+  capture_enabled = enable;
+  portEXIT_CRITICAL(&capture_mux);
+  return true;
+}
+
+size_t Wiimote::dump_capture(wiimote_capture_writer_t writer, void *ctx){
+  uint8_t header[24];
+  uint8_t *p = header;
+  memcpy(p, "btsnoop\0", 8);
+  p = _capture_be32(p + 8, 1); // version
+  p = _capture_be32(p, BTSNOOP_DATALINK_H4);
+  writer(ctx, header, p - header);
+  size_t written = p - header;
+  if(!capture_list){
+    return written;
+  }
+
+  portENTER_CRITICAL(&capture_mux);
+  uint32_t end = capture_count;
+  portEXIT_CRITICAL(&capture_mux);
+  uint32_t begin = end < WIIMOTE_CAPTURE_SIZE ? 0 : end - WIIMOTE_CAPTURE_SIZE;
+  for(uint32_t i=begin; i<end; i++){
+    capture_record_t r;
+    portENTER_CRITICAL(&capture_mux);
+    bool overwritten = WIIMOTE_CAPTURE_SIZE <= capture_count - i; // lapped while dumping
+    if(!overwritten){
+      r = capture_list[i % WIIMOTE_CAPTURE_SIZE];
+    }
+    portEXIT_CRITICAL(&capture_mux);
+    if(overwritten){
+      continue;
+    }
+    uint64_t timestamp = (uint64_t)(r.timestamp + BTSNOOP_EPOCH_OFFSET);
+    p = header;
+    p = _capture_be32(p, r.original_len);
+    p = _capture_be32(p, r.included_len);
+    p = _capture_be32(p, r.flags);
+    p = _capture_be32(p, 0); // cumulative drops
+    p = _capture_be32(p, timestamp >> 32);
+    p = _capture_be32(p, timestamp & 0xFFFFFFFF);
+    writer(ctx, header, p - header);
+    writer(ctx, r.data, r.included_len);
+    written += (p - header) + r.included_len;
+  }
+  return written;
+}
+
+void Wiimote::get_stats(wiimote_stats_t *out){
+  out->rx_packets     = stats.rx_packets.load(std::memory_order_relaxed);
+  out->rx_bytes       = stats.rx_bytes.load(std::memory_order_relaxed);
+  out->rx_dropped     = stats.rx_dropped.load(std::memory_order_relaxed);
+  out->rx_high_water  = stats.rx_high_water.load(std::memory_order_relaxed);
+  out->tx_packets     = stats.tx_packets.load(std::memory_order_relaxed);
+  out->tx_bytes       = stats.tx_bytes.load(std::memory_order_relaxed);
+  out->tx_dropped     = stats.tx_dropped.load(std::memory_order_relaxed);
+  out->tx_high_water  = stats.tx_high_water.load(std::memory_order_relaxed);
+  out->alloc_failures = stats.alloc_failures.load(std::memory_order_relaxed);
+  out->unhandled      = stats.unhandled.load(std::memory_order_relaxed);
+  out->connections    = stats.connections.load(std::memory_order_relaxed);
+  out->reconnects     = stats.reconnects.load(std::memory_order_relaxed);
+  out->disconnects    = stats.disconnects.load(std::memory_order_relaxed);
+  out->name_requests_skipped = stats.name_requests_skipped.load(std::memory_order_relaxed);
+  for(int i=0; i<WIIMOTE_STATS_HCI_EVENTS; i++){
+    out->hci_events[i] = stats.hci_events[i].load(std::memory_order_relaxed);
+  }
+  for(int i=0; i<WIIMOTE_STATS_CONNECTIONS; i++){
+    connection_counters_t *counters = &stats.connection[i];
+    uint16_t handle;
+    uint32_t reports;
+    do{
+      handle  = counters->handle.load(std::memory_order_acquire);
+      reports = counters->reports.load(std::memory_order_acquire);
+    }while(counters->handle.load(std::memory_order_relaxed) != handle);
+    out->connection[i].handle  = handle;
+    out->connection[i].reports = handle ? reports : 0;
+  }
+}
+
+bool Wiimote::get_latency(uint16_t handle, wiimote_latency_t *latency, bool reset){
+  connection_t *c = connection_find(handle);
+  if(!c){
+    return false;
+  }
+  memcpy(latency, &c->latency, sizeof(wiimote_latency_t));
+  if(reset){
+    memset(&c->latency, 0, sizeof(wiimote_latency_t));
+  }
+  return true;
+}
+
+uint32_t Wiimote::get_suppressed_reports(uint16_t handle){
+  connection_t *c = connection_find(handle);
+  return c ? c->report_filter.suppressed : 0;
+}
+
 void Wiimote::disconnect(uint16_t handle){
   l2cap_connection_remove_all(handle);
   // Disconnect HCI
-  uint16_t len = make_cmd_disconnect(tmp_data, handle);
-  _queue_data(_tx_queue, tmp_data, len); // TODO: check return
+  uint8_t *buf = tx_slot_acquire(&_cmd_pool);
+  uint16_t len = make_cmd_disconnect(buf, handle);
+  tx_slot_commit(&_cmd_pool, len);
 }
 
 void Wiimote::get_balance_weight(uint8_t *data, float *weight) {
@@ -1221,6 +3573,77 @@ void Wiimote::get_balance_weight(uint8_t *data, float *weight) {
   weight[BALANCE_POSITION_BOTTOM_LEFT]  = balance_interpolate(BALANCE_POSITION_BOTTOM_LEFT, values, balance_calibration);
 }
 
+const wiimote_report_t* Wiimote::get_report() {
+  return current_report_ptr;
+}
+
+bool Wiimote::get_balance_weight(uint16_t handle, uint8_t *data, int32_t *weight) {
+  connection_t *c = connection_find(handle);
+  if(!c || !c->balance_calibrated){
+    return false;
+  }
+  uint8_t* ext = data+4;
+  weight[BALANCE_POSITION_TOP_RIGHT]    = balance_sensor_convert(&c->balance_sensor[BALANCE_POSITION_TOP_RIGHT],    ext[0] << 8 | ext[1]);
+  weight[BALANCE_POSITION_BOTTOM_RIGHT] = balance_sensor_convert(&c->balance_sensor[BALANCE_POSITION_BOTTOM_RIGHT], ext[2] << 8 | ext[3]);
+  weight[BALANCE_POSITION_TOP_LEFT]     = balance_sensor_convert(&c->balance_sensor[BALANCE_POSITION_TOP_LEFT],     ext[4] << 8 | ext[5]);
+  weight[BALANCE_POSITION_BOTTOM_LEFT]  = balance_sensor_convert(&c->balance_sensor[BALANCE_POSITION_BOTTOM_LEFT],  ext[6] << 8 | ext[7]);
+  return true;
+}
+
 void Wiimote::initiate_auth(uint16_t handle) {
   _initiate_auth(handle);
 }
+
+void Wiimote::clear_link_keys(){
+  link_key_load();
+  link_key_lru.size = 0;
+  link_key_save();
+}
+
+bool Wiimote::forget(const uint8_t *bd_addr){
+  bd_addr_t addr;
+  memcpy(addr.addr, bd_addr, BD_ADDR_LEN);
+  bool found = link_key_remove(&addr);
+  if(found){
+    link_key_save();
+  }
+  device_cache_forget(&addr); // a connected remote stores it again only if the queries find something new
+  return found;
+}
+
+bool Wiimote::forget_handle(uint16_t handle){
+  connection_t *c = connection_find(handle);
+  return c && forget(c->bd_addr.addr);
+}
+
+uint16_t Wiimote::get_acl_outstanding(uint16_t handle){
+  connection_t *c = connection_find(handle);
+  return c ? c->acl_outstanding : 0;
+}
+
+uint16_t Wiimote::get_acl_credits(){
+  return acl_credits;
+}
+
+size_t Wiimote::read_trace(wiimote_trace_record_t *records, size_t max){
+  uint32_t end = trace_count.load(std::memory_order_relaxed);
+  uint32_t n = end < WIIMOTE_TRACE_SIZE ? end : WIIMOTE_TRACE_SIZE;
+  if(max < n){
+    n = max;
+  }
+  for(uint32_t i=0; i<n; i++){
+    records[i] = trace_list[(end - n + i) & (WIIMOTE_TRACE_SIZE-1)];
+  }
+  return n;
+}
+
+void Wiimote::print_trace(){
+  static const char *names[] = { "SEND", "HCI_EVENT", "ACL_DATA", "REPORT" };
+  wiimote_trace_record_t r;
+  uint32_t end = trace_count.load(std::memory_order_relaxed);
+  uint32_t n = end < WIIMOTE_TRACE_SIZE ? end : WIIMOTE_TRACE_SIZE;
+  for(uint32_t i=0; i<n; i++){
+    r = trace_list[(end - n + i) & (WIIMOTE_TRACE_SIZE-1)];
+    log_i("%10u %-9s %04X %08X %08X", (unsigned)r.timestamp, r.event < sizeof(names)/sizeof(names[0]) ? names[r.event] : "?", r.arg0, (unsigned)r.arg1, (unsigned)r.arg2);
+  }
+}
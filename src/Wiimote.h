@@ -2,6 +2,7 @@
 #define _WIIMOTE_H_
 
 #include <cstdint>
+#include <cstddef>
 
 enum wiimote_event_type_t {
   WIIMOTE_EVENT_INITIALIZE,
@@ -20,20 +21,237 @@ enum balance_position_type_t {
   BALANCE_POSITION_BOTTOM_LEFT,
 };
 
+// wiimote_report_t.buttons
+#define WIIMOTE_BUTTON_LEFT  0x0100
+#define WIIMOTE_BUTTON_RIGHT 0x0200
+#define WIIMOTE_BUTTON_DOWN  0x0400
+#define WIIMOTE_BUTTON_UP    0x0800
+#define WIIMOTE_BUTTON_PLUS  0x1000
+#define WIIMOTE_BUTTON_TWO   0x0001
+#define WIIMOTE_BUTTON_ONE   0x0002
+#define WIIMOTE_BUTTON_B     0x0004
+#define WIIMOTE_BUTTON_A     0x0008
+#define WIIMOTE_BUTTON_MINUS 0x0010
+#define WIIMOTE_BUTTON_HOME  0x0080
+
+// Latest input of a remote, see Wiimote::get_state().
+struct wiimote_state_t {
+  uint32_t sequence;    // reports applied since connecting, 0 = none yet
+  uint32_t timestamp;   // receive time of the last report, esp_timer microseconds (low 32 bits)
+  uint8_t report_id;
+  uint16_t buttons;     // WIIMOTE_BUTTON_*
+  bool has_accel_mg;
+  int16_t accel_mg[3];
+  bool has_pointer;
+  uint16_t pointer[2];
+  bool has_weight;      // balance board, see wiimote_report_t
+  int32_t weight[4];    // [g] indexed by balance_position_type_t
+  int32_t total_weight; // [g]
+  bool has_cop;
+  int16_t cop[2];       // [0.1 mm]
+  uint8_t ext_len;
+  uint8_t ext[21];      // raw extension bytes
+};
+
+// Log2 histograms in microseconds: bucket n counts [2^n, 2^(n+1)), bucket 0 also 0, the last bucket everything above.
+// Only data reports (0x30-0x3F) delivered to the callback are recorded, not those dropped by set_report_filter().
+#define WIIMOTE_LATENCY_BUCKETS 20
+struct wiimote_latency_t {
+  uint32_t residency[WIIMOTE_LATENCY_BUCKETS]; // packet received -> report dispatched to the callback
+  uint32_t interval[WIIMOTE_LATENCY_BUCKETS];  // between consecutive delivered reports of the remote
+};
+
+#define WIIMOTE_STATS_HCI_EVENTS  0x40
+#define WIIMOTE_STATS_CONNECTIONS 7
+struct wiimote_stats_t {
+  uint32_t rx_packets;     // from the controller
+  uint32_t rx_bytes;
+  uint32_t rx_dropped;     // RX ring full
+  uint32_t rx_high_water;  // most packets waiting in the RX ring
+  uint32_t tx_packets;     // to the controller
+  uint32_t tx_bytes;
+  uint32_t tx_dropped;     // TX slot pool full
+  uint32_t tx_high_water;  // most packets waiting in a TX slot pool
+  uint32_t alloc_failures; // connection table full
+  uint32_t unhandled;      // HCI events, L2CAP frames and HID transactions without a handler
+  uint32_t connections;    // ACL links established
+  uint32_t reconnects;     // of those, by a remote connected before
+  uint32_t disconnects;
+  uint32_t name_requests_skipped; // inquiry results of known remotes or remotes named in EIR data, connected without a remote name request
+  uint32_t hci_events[WIIMOTE_STATS_HCI_EVENTS]; // by event code
+  struct {
+    uint16_t handle;       // 0 = slot unused
+    uint32_t reports;      // data reports delivered to the callback since connecting
+  } connection[WIIMOTE_STATS_CONNECTIONS];
+};
+
+// set_report_filter() report_ids
+#define WIIMOTE_REPORT_FILTER(id) (1UL << ((id) - 0x20)) // id 0x20-0x3F
+#define WIIMOTE_REPORT_FILTER_ALL 0xFFFF0000UL           // data reports 0x30-0x3F
+
+// IR camera data format, values are the camera mode numbers.
+enum wiimote_ir_mode_t {
+  WIIMOTE_IR_OFF      = 0,
+  WIIMOTE_IR_BASIC    = 1, // reporting mode 0x36, 0x37 (position only, leaves room for extension bytes)
+  WIIMOTE_IR_EXTENDED = 3, // reporting mode 0x33 (position and size)
+  WIIMOTE_IR_FULL     = 5  // reporting mode 0x3E/0x3F (position, size, bounding box and intensity)
+};
+
+struct wiimote_ir_blob_t {
+  uint16_t x;        // 0-1023, 1023 when not tracked
+  uint16_t y;        // 0-767, 1023 when not tracked
+  uint8_t size;      // 0-15, extended and full mode
+  uint8_t intensity; // full mode
+};
+
+// Fields of an input report. ir and ext point into the report buffer; a NULL pointer means the
+// reporting mode does not carry that field.
+struct wiimote_report_t {
+  uint8_t id;              // data[1]
+  int64_t timestamp;       // esp_timer microseconds when the packet was received from the controller
+  bool has_buttons;
+  bool has_accel;
+  uint16_t buttons;        // WIIMOTE_BUTTON_*
+  uint16_t accel[3];       // x, y, z (10 bits; the LSB of y and z is always 0)
+  bool has_accel_mg;       // set once the remote's calibration has been read
+  int16_t accel_mg[3];     // x, y, z calibrated [mg]
+  const uint8_t *ir;       // 10 bytes (basic) or 12 bytes (extended), 18 in the interleaved modes
+  uint8_t ir_len;
+  const uint8_t *ext;
+  uint8_t ext_len;
+  const wiimote_ir_blob_t *ir_blobs; // 4 decoded blobs when the report carries IR data
+  bool has_pointer;                  // at least one blob is tracked
+  uint16_t pointer[2];               // x, y in camera pixels, mirrored so x grows to the right
+  bool has_weight;                   // balance board, set once its calibration has been read
+  int32_t weight[4];                 // [g] indexed by balance_position_type_t, filtered and tared (set_balance_filter)
+  int32_t total_weight;              // [g] sum of weight
+  bool has_cop;                      // total_weight is at least WIIMOTE_BALANCE_COP_MIN_WEIGHT
+  int16_t cop[2];                    // center of pressure x, y [0.1 mm] from the board center, x to the right, y to the top sensors
+};
+
+// Balance board sensor spacing, wiimote_report_t.cop spans +-half of it.
+#define WIIMOTE_BALANCE_WIDTH  4330 // [0.1 mm] left to right
+#define WIIMOTE_BALANCE_LENGTH 2380 // [0.1 mm] bottom to top
+#define WIIMOTE_BALANCE_COP_MIN_WEIGHT 1000 // [g]
+
+enum wiimote_trace_event_t {
+  WIIMOTE_TRACE_SEND,      // arg0=len, arg1=bytes 0-3, arg2=bytes 4-7
+  WIIMOTE_TRACE_HCI_EVENT, // arg0=event code, arg1=len, arg2=parameter bytes 0-3
+  WIIMOTE_TRACE_ACL_DATA,  // arg0=handle, arg1=len, arg2=L2CAP payload bytes 0-3
+  WIIMOTE_TRACE_REPORT     // arg0=handle, arg1=len, arg2=report bytes 0-3
+};
+
+struct wiimote_trace_record_t {
+  uint32_t timestamp; // esp_timer microseconds (low 32 bits)
+  uint16_t event;     // wiimote_trace_event_t
+  uint16_t arg0;
+  uint32_t arg1;
+  uint32_t arg2;
+};
+
+enum wiimote_address_space_t {
+  WIIMOTE_EEPROM_MEMORY,
+  WIIMOTE_CONTROL_REGISTER
+};
+
+// Error codes passed to wiimote_memory_callback_t, besides the remote's own (SE low nibble / 0x22 error byte).
+#define WIIMOTE_MEMORY_OK           0x00
+#define WIIMOTE_MEMORY_MISMATCH     0xFC // read data for another address arrived, the rest of the read is lost
+#define WIIMOTE_MEMORY_TIMEOUT      0xFD // no answer for a second
+#define WIIMOTE_MEMORY_DROPPED      0xFE // TX slot pool full, part of a write was not sent
+#define WIIMOTE_MEMORY_DISCONNECTED 0xFF // the remote went away before answering
+
+// Called once per read_memory() / write_memory() request. data is the caller's buffer (NULL for writes).
+typedef void (* wiimote_memory_callback_t)(uint16_t handle, uint8_t error, uint8_t *data, uint16_t size, void *ctx);
+
+// Wiimote::set_inquiry() mode, values are the HCI Inquiry_Mode.
+enum wiimote_inquiry_mode_t {
+  WIIMOTE_INQUIRY_STANDARD = 0, // Inquiry Result, no RSSI
+  WIIMOTE_INQUIRY_RSSI     = 1, // Inquiry Result with RSSI
+  WIIMOTE_INQUIRY_EXTENDED = 2  // Extended Inquiry Result from devices that send EIR data, with RSSI otherwise
+};
+
+// Receives consecutive chunks of a btsnoop file from Wiimote::dump_capture().
+typedef void (* wiimote_capture_writer_t)(void *ctx, const uint8_t *data, size_t len);
+
 typedef void (* wiimote_callback_t)(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len);
 
 
+// Not thread-safe: call handle() and the other methods from one task (the callback runs in it too).
+// Only get_state() and get_stats() can be called from any task.
 class Wiimote {
   public:
     void init(wiimote_callback_t cb);
     void handle();
+    // Sends and processes queued packets until max_packets (0 = no limit) or max_micros (0 = no limit)
+    // is used up. With neither limit, it takes the received packets waiting when called, and sends what it can.
+    // Returns the number of packets still waiting.
+    int handle(uint16_t max_packets, uint32_t max_micros);
     void scan(bool enable);
+    // Parameters of the next scan(true): length in 1.28 s units (1-0x30), max_responses 0 = unlimited.
+    // With RSSI, candidates are asked for their name strongest first. This only ranks the results that arrive
+    // while a name request is outstanding: the first candidate is asked as soon as it is found, and known
+    // remotes or names in EIR data connect right away, whatever their RSSI.
+    void set_inquiry(uint8_t length, uint8_t max_responses = 0, wiimote_inquiry_mode_t mode = WIIMOTE_INQUIRY_RSSI);
     void _callback(wiimote_event_type_t event_type, uint16_t handle, uint8_t *data, size_t len);
     void set_led(uint16_t handle, uint8_t leds);
     void set_rumble(uint16_t handle, bool rumble);
+    // Switches to a reporting mode with accelerometer data (0x31, or 0x35 with a Nunchuk).
+    void set_accelerometer(uint16_t handle, bool enable);
+    // Runs the IR camera enable sequence (sensitivity 1-5) and switches to a reporting mode carrying IR data.
+    void set_ir(uint16_t handle, wiimote_ir_mode_t mode, uint8_t sensitivity = 3);
+    // Drops reports of the selected ids (WIIMOTE_REPORT_FILTER_*) that repeat the last delivered one.
+    // The interleaved halves 0x3E and 0x3F are each compared with the last delivered report of the same id.
+    // Accelerometer changes up to accel_threshold counts per axis count as a repeat. report_ids=0 turns it off.
+    void set_report_filter(uint16_t handle, uint32_t report_ids, uint16_t accel_threshold = 0);
+    // Copies the latest state of the remote. Lock-free, can be called from any task. Returns false if not connected.
+    bool get_state(uint16_t handle, wiimote_state_t *state);
+    // Balance board filtering, applied to wiimote_report_t.weight: a 3-sample median per sensor against spikes, then
+    // an IIR low-pass with coefficient 1/2^smoothing (0 = off). zero_tracking slowly follows drift of the empty board.
+    void set_balance_filter(uint16_t handle, uint8_t smoothing, bool median = false, bool zero_tracking = false);
+    // Takes the current (filtered) load of the board as zero. Returns false if it is not a calibrated balance board.
+    bool tare_balance(uint16_t handle);
+    // Reads size bytes into buffer, which must stay valid until callback runs. Requests are pipelined: several
+    // can be outstanding per remote and the 16-byte 0x21 chunks are reassembled. Returns false if not queued.
+    bool read_memory(uint16_t handle, wiimote_address_space_t space, uint32_t offset, uint16_t size, uint8_t *buffer, wiimote_memory_callback_t callback, void *ctx = NULL);
+    // Writes size bytes (sent as 16-byte 0x16 reports), callback runs when every chunk is acknowledged.
+    // Both fail with WIIMOTE_MEMORY_TIMEOUT if the remote stops answering; handle() checks for that.
+    bool write_memory(uint16_t handle, wiimote_address_space_t space, uint32_t offset, uint16_t size, const uint8_t *data, wiimote_memory_callback_t callback, void *ctx = NULL);
+    // Starts or stops recording every HCI packet into the capture ring. Returns false if the ring can't be allocated.
+    bool set_capture(bool enable);
+    // Writes the capture ring as a btsnoop file (H4), oldest packet first. Returns the number of bytes written.
+    size_t dump_capture(wiimote_capture_writer_t writer, void *ctx);
+    // Copies the stack counters. Can be called from any task.
+    void get_stats(wiimote_stats_t *stats);
+    // Copies the latency histograms of the remote, optionally clearing them. Returns false if not connected.
+    bool get_latency(uint16_t handle, wiimote_latency_t *latency, bool reset = false);
+    // Reports dropped by the filter since connecting.
+    uint32_t get_suppressed_reports(uint16_t handle);
+    // Uses the calibration of the balance board calibrated last.
     void get_balance_weight(uint8_t *data, float *weight);
+    // Decodes the report passed with WIIMOTE_EVENT_DATA. Only valid inside the callback.
+    const wiimote_report_t* get_report();
+    // Decodes a report (starting with 0xA1). Returns false if it is not an input report.
+    static bool decode_report(const uint8_t *data, size_t len, wiimote_report_t *report);
+    // Weight per sensor in grams, using the calibration of this board. Returns false until it has been read.
+    bool get_balance_weight(uint16_t handle, uint8_t *data, int32_t *weight);
     void initiate_auth(uint16_t handle);
+    // Link keys and the device cache are stored unencrypted in the "wiimote" NVS namespace; enable NVS
+    // encryption to protect them. clear_link_keys() deletes every link key, so paired remotes pair again.
+    void clear_link_keys();
+    // Deletes the link key and device cache entry of the remote (bd_addr most significant byte first, or a
+    // connected handle). Returns false if it had no link key. Writes to flash: don't call it in the callback.
+    bool forget(const uint8_t *bd_addr);
+    bool forget_handle(uint16_t handle);
     void disconnect(uint16_t handle);
+    // ACL packets sent on the link and not yet reported completed by the controller.
+    uint16_t get_acl_outstanding(uint16_t handle);
+    // ACL buffers currently free in the controller.
+    uint16_t get_acl_credits();
+    // Copies the most recent trace records, oldest first. Returns the number copied.
+    size_t read_trace(wiimote_trace_record_t *records, size_t max);
+    // Formats the trace ring to the log.
+    void print_trace();
   private:
     wiimote_callback_t _wiimote_callback;
 };
@@ -9,20 +9,24 @@
 // OGF + OCF
 #define HCI_RESET                          (0x0003 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_READ_BD_ADDR                   (0x0009 | HCI_GRP_INFO_PARAMS_CMDS)
+#define HCI_READ_BUFFER_SIZE               (0x0005 | HCI_GRP_INFO_PARAMS_CMDS)
 #define HCI_WRITE_LOCAL_NAME               (0x0013 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_WRITE_CLASS_OF_DEVICE          (0x0024 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_WRITE_SCAN_ENABLE              (0x001A | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
+#define HCI_WRITE_INQUIRY_MODE             (0x0045 | HCI_GRP_HOST_CONT_BASEBAND_CMDS)
 #define HCI_INQUIRY                        (0x0001 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_INQUIRY_CANCEL                 (0x0002 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_REMOTE_NAME_REQUEST            (0x0019 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_CREATE_CONNECTION              (0x0005 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_AUTHENTICATION                 (0x0011 | HCI_GRP_LINK_CONT_CMDS)
+#define HCI_LINK_KEY_REPLY                 (0x000B | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_NEGATIVE_REPLY                 (0x000C | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_PIN_REPLY                      (0x000D | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_ACCEPT_CONNECTION              (0x0009 | HCI_GRP_LINK_CONT_CMDS)
 #define HCI_DISCONNECT                     (0x0006 | HCI_GRP_LINK_CONT_CMDS)
 
 #define BD_ADDR_LEN     (6)
+#define LINK_KEY_LEN    (16)
 struct bd_addr_t {
   uint8_t addr[BD_ADDR_LEN];
 };
@@ -54,6 +58,13 @@ static uint16_t make_cmd_read_bd_addr(uint8_t *buf){
   return HCI_H4_CMD_PREAMBLE_SIZE;
 }
 
+static uint16_t make_cmd_read_buffer_size(uint8_t *buf){
+  UINT8_TO_STREAM (buf, H4_TYPE_COMMAND);
+  UINT16_TO_STREAM (buf, HCI_READ_BUFFER_SIZE);
+  UINT8_TO_STREAM (buf, 0);
+  return HCI_H4_CMD_PREAMBLE_SIZE;
+}
+
 static uint16_t make_cmd_write_local_name(uint8_t *buf, uint8_t* name, uint8_t len){
   // name ends with null. TODO check len<=248
   UINT8_TO_STREAM (buf, H4_TYPE_COMMAND);
@@ -85,6 +96,15 @@ static uint16_t make_cmd_write_scan_enable(uint8_t *buf, uint8_t mode){
   return HCI_H4_CMD_PREAMBLE_SIZE + 1;
 }
 
+static uint16_t make_cmd_write_inquiry_mode(uint8_t *buf, uint8_t mode){
+  UINT8_TO_STREAM (buf, H4_TYPE_COMMAND);
+  UINT16_TO_STREAM (buf, HCI_WRITE_INQUIRY_MODE);
+  UINT8_TO_STREAM (buf, 1);
+
+  UINT8_TO_STREAM (buf, mode); // 0x00=standard, 0x01=with RSSI, 0x02=with RSSI or extended
+  return HCI_H4_CMD_PREAMBLE_SIZE + 1;
+}
+
 static uint16_t make_cmd_inquiry(uint8_t *buf, uint32_t lap, uint8_t len, uint8_t num){
   UINT8_TO_STREAM (buf, H4_TYPE_COMMAND);
   UINT16_TO_STREAM (buf, HCI_INQUIRY);
@@ -152,6 +172,17 @@ static uint16_t make_cmd_negative_reply(uint8_t *buf, struct bd_addr_t bd_addr){
   return HCI_H4_CMD_PREAMBLE_SIZE + 6;
 }
 
+static uint16_t make_cmd_link_key_reply(uint8_t *buf, struct bd_addr_t bd_addr, const uint8_t key[LINK_KEY_LEN]){
+  UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
+  UINT16_TO_STREAM(buf, HCI_LINK_KEY_REPLY);
+  UINT8_TO_STREAM(buf, 6 + LINK_KEY_LEN); // 22
+
+  BDADDR_TO_STREAM(buf, bd_addr.addr);
+  ARRAY_TO_STREAM(buf, key, LINK_KEY_LEN);
+
+  return HCI_H4_CMD_PREAMBLE_SIZE + 22;
+}
+
 static uint16_t make_cmd_pin_reply(uint8_t *buf, struct bd_addr_t bd_addr, uint8_t pin[6]){
   UINT8_TO_STREAM(buf, H4_TYPE_COMMAND);
   UINT16_TO_STREAM(buf, HCI_PIN_REPLY);
@@ -195,17 +226,22 @@ static uint16_t make_cmd_disconnect(uint8_t *buf, uint16_t connection_handle)
   return HCI_H4_CMD_PREAMBLE_SIZE + 3;
 }
 
-// TODO long data is split to multi packets
-static uint16_t make_l2cap_single_packet(uint8_t *buf, uint16_t channel_id, uint8_t *data, uint16_t len){
+#define L2CAP_HEADER_SIZE                  (4)
+#define L2CAP_MTU                          (256) // largest L2CAP payload accepted, announced in Configuration Request
+
+// The L2CAP payload is written in place at ACL_L2CAP_PAYLOAD(buf) before the headers are made.
+#define ACL_L2CAP_PAYLOAD(buf)             ((buf) + HCI_H4_ACL_PREAMBLE_SIZE + L2CAP_HEADER_SIZE)
+
+// Frames longer than the controller's ACL_Data_Packet_Length are segmented when sent.
+static uint16_t make_l2cap_single_packet(uint8_t *buf, uint16_t channel_id, uint16_t len){
   UINT16_TO_STREAM (buf, len);
   UINT16_TO_STREAM (buf, channel_id); // 0x0001=Signaling channel
-  ARRAY_TO_STREAM (buf, data, len);
-  return 2 + 2 + len;
+  return L2CAP_HEADER_SIZE + len;
 }
 
-static uint16_t make_acl_l2cap_single_packet(uint8_t *buf, uint16_t connection_handle, uint8_t packet_boundary_flag, uint8_t broadcast_flag, uint16_t channel_id, uint8_t *data, uint8_t len){
+static uint16_t make_acl_l2cap_single_packet(uint8_t *buf, uint16_t connection_handle, uint8_t packet_boundary_flag, uint8_t broadcast_flag, uint16_t channel_id, uint16_t len){
   uint8_t* l2cap_buf = buf + HCI_H4_ACL_PREAMBLE_SIZE;
-  uint16_t l2cap_len = make_l2cap_single_packet(l2cap_buf, channel_id, data, len);
+  uint16_t l2cap_len = make_l2cap_single_packet(l2cap_buf, channel_id, len);
 
   UINT8_TO_STREAM (buf, H4_TYPE_ACL);
   UINT8_TO_STREAM (buf, connection_handle & 0xFF);
@@ -0,0 +1,145 @@
+#ifndef _WIIMOTE_HOST_H_
+#define _WIIMOTE_HOST_H_
+
+/**
+ * Host stand-ins for the ESP32 APIs used by Wiimote.cpp, selected with -DWIIMOTE_HOST.
+ * They let the stack run on a desktop, to replay captured HCI traffic and measure it (extras/host):
+ *
+ *   g++ -std=gnu++17 -O2 -DWIIMOTE_HOST -Isrc src/Wiimote.cpp extras/host/replay.cpp
+ *
+ *   wii.init(callback);
+ *   wiimote_host_send_hook = on_send;      // packets the stack sends, H4 framed
+ *   wiimote_host_receive(packet, len);     // packets from the "controller", H4 framed
+ *   wii.handle();                          // then Wiimote::get_stats() / get_latency()
+ *
+ * Logging is compiled out unless WIIMOTE_HOST_LOG is defined. NVS blobs are files named
+ * <namespace>.<key> in wiimote_host_nvs_dir.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_BLUEDROID_ENABLED 1
+#define CONFIG_CLASSIC_BT_ENABLED 1
+
+typedef int esp_err_t;
+#define ESP_OK   0
+#define ESP_FAIL -1
+
+#ifdef WIIMOTE_HOST_LOG
+#define log_d(format, ...) printf("[D] " format "\n", ##__VA_ARGS__)
+#define log_i(format, ...) printf("[I] " format "\n", ##__VA_ARGS__)
+#define log_e(format, ...) printf("[E] " format "\n", ##__VA_ARGS__)
+#else
+// disabled, but still type-checked and counted as uses of their arguments
+#define log_d(format, ...) do{ if(0) printf(format, ##__VA_ARGS__); }while(0)
+#define log_i(format, ...) do{ if(0) printf(format, ##__VA_ARGS__); }while(0)
+#define log_e(format, ...) do{ if(0) printf(format, ##__VA_ARGS__); }while(0)
+#endif
+
+typedef struct {
+  void (*notify_host_send_available)(void);
+  int (*notify_host_recv)(uint8_t *data, uint16_t len);
+} esp_vhci_host_callback_t;
+
+inline const esp_vhci_host_callback_t *wiimote_host_callback = NULL;
+inline void (*wiimote_host_send_hook)(uint8_t *data, uint16_t len) = NULL;
+inline bool wiimote_host_send_available = true; // set false to hold the stack's TX
+
+// Hands a packet from the controller to the stack, as the VHCI receive callback would.
+inline int wiimote_host_receive(uint8_t *data, uint16_t len){
+  return wiimote_host_callback ? wiimote_host_callback->notify_host_recv(data, len) : ESP_FAIL;
+}
+
+inline esp_err_t esp_vhci_host_register_callback(const esp_vhci_host_callback_t *callback){
+  wiimote_host_callback = callback;
+  return ESP_OK;
+}
+inline bool esp_vhci_host_check_send_available(void){
+  return wiimote_host_send_available;
+}
+inline void esp_vhci_host_send_packet(uint8_t *data, uint16_t len){
+  if(wiimote_host_send_hook){
+    wiimote_host_send_hook(data, len);
+  }
+}
+inline const char* esp_err_to_name(esp_err_t code){
+  return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+struct portMUX_TYPE {
+  std::atomic_flag flag;
+};
+#define portMUX_INITIALIZER_UNLOCKED { ATOMIC_FLAG_INIT }
+#define portENTER_CRITICAL(mux) while((mux)->flag.test_and_set(std::memory_order_acquire)){}
+#define portEXIT_CRITICAL(mux)  (mux)->flag.clear(std::memory_order_release)
+
+inline bool btStart(void){ return true; }
+inline bool btStarted(void){ return true; }
+
+#define ESP_MAC_BT 2
+inline esp_err_t esp_read_mac(uint8_t *mac, int type){
+  static const uint8_t host_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  memcpy(mac, host_mac, sizeof(host_mac));
+  return ESP_OK;
+}
+
+typedef uint32_t nvs_handle_t;
+typedef enum {
+  NVS_READONLY,
+  NVS_READWRITE
+} nvs_open_mode_t;
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+
+inline const char *wiimote_host_nvs_dir = ".";
+inline char wiimote_host_nvs_namespace[16]; // of the open handle, one at a time
+
+inline void wiimote_host_nvs_path(const char *key, char *path, size_t size){
+  snprintf(path, size, "%s/%s.%s", wiimote_host_nvs_dir, wiimote_host_nvs_namespace, key);
+}
+inline esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle){
+  snprintf(wiimote_host_nvs_namespace, sizeof(wiimote_host_nvs_namespace), "%s", name);
+  *out_handle = 1;
+  return ESP_OK;
+}
+inline esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length){
+  char path[256];
+  wiimote_host_nvs_path(key, path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  if(!file){
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  *length = fread(out_value, 1, *length, file);
+  fclose(file);
+  return ESP_OK;
+}
+inline esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length){
+  char path[256];
+  wiimote_host_nvs_path(key, path, sizeof(path));
+  FILE *file = fopen(path, "wb");
+  if(!file){
+    return ESP_FAIL;
+  }
+  size_t written = fwrite(value, 1, length, file);
+  fclose(file);
+  return written == length ? ESP_OK : ESP_FAIL;
+}
+inline esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key){
+  char path[256];
+  wiimote_host_nvs_path(key, path, sizeof(path));
+  return remove(path) == 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+inline esp_err_t nvs_commit(nvs_handle_t handle){ return ESP_OK; }
+inline void nvs_close(nvs_handle_t handle){}
+
+inline int64_t esp_timer_get_time(void){
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif